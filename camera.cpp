@@ -23,6 +23,7 @@
 
 #include <camera.h>
 #include <PS1080.h>
+#include <cstddef>
 
 
 RGBD_Camera::RGBD_Camera(unsigned int res_factor)
@@ -124,24 +125,18 @@ void RGBD_Camera::loadFrame(Eigen::MatrixXf &depth_wf, Eigen::MatrixXf &color_wf
 
     else
     {
-        //Read new frame
-        const openni::DepthPixel* pDepthRow = (const openni::DepthPixel*)framed.getData();
-        const openni::RGB888Pixel* pRgbRow = (const openni::RGB888Pixel*)framergb.getData();
-        int rowSize = framergb.getStrideInBytes() / sizeof(openni::RGB888Pixel);
+        //Read new frame: the buffers are mapped as row-major Eigen views (one per channel) and flipped in both directions
+        typedef Eigen::Map<const Eigen::Matrix<unsigned char, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>, 0, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic> > ChannelView;
+        typedef Eigen::Map<const Eigen::Matrix<openni::DepthPixel, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>, 0, Eigen::OuterStride<> > DepthView;
+        const unsigned char *rgb_data = (const unsigned char*)framergb.getData();
+        const Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic> rgb_stride(framergb.getStrideInBytes(), sizeof(openni::RGB888Pixel));
+        const DepthView depth_raw((const openni::DepthPixel*)framed.getData(), height, width, Eigen::OuterStride<>(framed.getStrideInBytes()/sizeof(openni::DepthPixel)));
 		const float max_dist_mm = 1000.f*max_distance;
 
-        for (int yc = height-1; yc >= 0; --yc)
-        {
-            const openni::RGB888Pixel* pRgb = pRgbRow;
-            const openni::DepthPixel* pDepth = pDepthRow;
-            for (int xc = width-1; xc >= 0; --xc, ++pRgb, ++pDepth)
-            {
-                color_wf(yc,xc) = norm_factor*(0.299f*pRgb->r + 0.587f*pRgb->g + 0.114f*pRgb->b);
-                depth_wf(yc,xc) = 0.001f*(*pDepth)*(*pDepth < max_dist_mm);
-            }
-            pRgbRow += rowSize;
-            pDepthRow += rowSize;
-        }
+        color_wf = (norm_factor*(0.299f*ChannelView(rgb_data + offsetof(openni::RGB888Pixel, r), height, width, rgb_stride).cast<float>()
+                               + 0.587f*ChannelView(rgb_data + offsetof(openni::RGB888Pixel, g), height, width, rgb_stride).cast<float>()
+                               + 0.114f*ChannelView(rgb_data + offsetof(openni::RGB888Pixel, b), height, width, rgb_stride).cast<float>())).reverse();
+        depth_wf = (depth_raw.cast<float>().array() < max_dist_mm).select(0.001f*depth_raw.cast<float>().array(), 0.f).matrix().reverse();
     }
 }
 
@@ -27,6 +27,19 @@ using namespace mrpt;
 using namespace mrpt::obs;
 using namespace std;
 
+//Subsampled view of an image flipped in both directions: view(i,j) = image(height-downsample*i-1, width-downsample*j-1).
+//The strided map starts at the last sampled pixel and is read with reverse(), for either storage order
+template<typename MatrixType>
+inline Eigen::Reverse<const Eigen::Map<const Eigen::Matrix<typename MatrixType::Scalar, Eigen::Dynamic, Eigen::Dynamic, MatrixType::IsRowMajor ? Eigen::RowMajor : Eigen::ColMajor>, 0, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic> >, Eigen::BothDirections>
+	flippedView(const MatrixType &image, unsigned int rows, unsigned int cols, unsigned int downsample)
+{
+	typedef Eigen::Map<const Eigen::Matrix<typename MatrixType::Scalar, Eigen::Dynamic, Eigen::Dynamic, MatrixType::IsRowMajor ? Eigen::RowMajor : Eigen::ColMajor>, 0, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic> > View;
+	const unsigned int row_0 = image.rows() - downsample*(rows-1) - 1, col_0 = image.cols() - downsample*(cols-1) - 1;
+	const unsigned int outer_0 = MatrixType::IsRowMajor ? row_0 : col_0, inner_0 = MatrixType::IsRowMajor ? col_0 : row_0;
+	const View view(image.data() + outer_0*image.outerStride() + inner_0, rows, cols, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(downsample*image.outerStride(), downsample));
+	return view.reverse();
+}
+
 
 Datasets::Datasets(unsigned int res_factor)
 {
@@ -120,19 +133,13 @@ void Datasets::loadFrameAndPoseFromDataset(Eigen::MatrixXf &depth_wf, Eigen::Mat
 	int_image.getAsMatrix(intensity);
 	int_image.getAsRGBMatrices(r, g, b);
 
-	for (unsigned int j = 0; j<cols; j++)
-		for (unsigned int i = 0; i<rows; i++)
-		{
-			intensity_wf(i,j) = intensity(height-downsample*i-1, width-downsample*j-1);
-			const float z = range(height-downsample*i-1, width-downsample*j-1);
-			if (z < max_distance)	depth_wf(i,j) = z;
-			else					depth_wf(i,j) = 0.f;
-
-			//Color image, just for the visualization
-			im_r(i,j) = b(height-downsample*i-1, width-downsample*j-1);
-			im_g(i,j) = g(height-downsample*i-1, width-downsample*j-1);
-			im_b(i,j) = r(height-downsample*i-1, width-downsample*j-1);
-		}
+	intensity_wf = flippedView(intensity, rows, cols, downsample);
+	depth_wf = (flippedView(range, rows, cols, downsample).array() < max_distance).select(flippedView(range, rows, cols, downsample).array(), 0.f).matrix();
+
+	//Color image, just for the visualization
+	im_r = flippedView(b, rows, cols, downsample);
+	im_g = flippedView(g, rows, cols, downsample);
+	im_b = flippedView(r, rows, cols, downsample);
 
 
 	timestamp_obs = mrpt::system::timestampTotime_t(obs3D->timestamp);
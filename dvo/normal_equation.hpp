@@ -136,6 +136,11 @@ struct NormalEquation<float, 6, 1> : public NormalEquationBase<NormalEquation<fl
   void get(Traits::MatrixA &A, Traits::VectorB &b);
 
   void update(const Traits::JacobianMatrix &jacobian, const Traits::ResidualVector &residual, const Traits::InformationMatrix &information);
+
+  // jacobian must be 16-byte aligned and padded to 8 floats
+  void update(float const *jacobian, float residual, float information);
+
+  void add(NormalEquation<float, 6, 1> const &o);
 };
 
 template<>
@@ -31,31 +31,46 @@
 #include <mrpt/gui/CDisplayWindow3D.h>
 #include <mrpt/opengl.h>
 #include <Eigen/Core>
-#include <unsupported/Eigen/MatrixFunctions>
 #include <opencv2/opencv.hpp>
+#include <se3.h>
 
 
 #define NUM_LABELS 24
 //#define NUM_LABELS 128
+#define EXP_TABLE_SIZE 1024
 
 typedef Eigen::Matrix<float, 6, 1> Vector6f;
+typedef Eigen::Matrix<unsigned char, Eigen::Dynamic, Eigen::Dynamic> MatrixLabels;	//Labels (NUM_LABELS must fit in it, NUM_LABELS means no label)
 typedef Eigen::Matrix<float, 2, 6> JacobianT;
 typedef Eigen::Matrix<float, 2, 1> ResidualT;
 
 static const int JacobianElements = JacobianT::RowsAtCompileTime * JacobianT::ColsAtCompileTime;
 static const int ResidualElements = ResidualT::RowsAtCompileTime * ResidualT::ColsAtCompileTime;
 
+//How the Jacobians of the first solve are kept for the IRLS iterations
+enum JacobianStorage { STORE_NONE, STORE_FLOAT };
+
+//State of a tile for the incremental clustering (unchanged, some pixels changed or most of it changed)
+enum TileState { TILE_CLEAN, TILE_PARTIALLY_DIRTY, TILE_DIRTY };
+
 struct SolveForMotionWorkspace
 {
-    float *A, *B;
+    float *A, *B;						//Only allocated the first time the Jacobians are stored as floats
     std::vector<std::pair<int,int> > indices;
+    int max_npoints;
 
-    SolveForMotionWorkspace(int max_npoints)
+    SolveForMotionWorkspace(int max_npoints) : A(0), B(0), max_npoints(max_npoints)
     {
-        A = new float[max_npoints * JacobianElements];
-        B = new float[max_npoints * ResidualElements];
         indices.reserve(max_npoints);
     }
+    void allocate(JacobianStorage storage)
+    {
+        if ((storage == STORE_FLOAT)&&(A == 0))
+        {
+            A = new float[max_npoints * JacobianElements];
+            B = new float[max_npoints * ResidualElements];
+        }
+    }
     ~SolveForMotionWorkspace()
     {
         delete[] A;
@@ -63,6 +78,104 @@ struct SolveForMotionWorkspace
     }
 };
 
+//Camera parameters of a level of the pyramid, used to compute the coordinates "xy" of the points from their depth
+struct LevelIntrinsics
+{
+    float f, inv_f;				//Focal length (in pixels) and its inverse
+    float disp_u, disp_v;		//Principal point
+
+    void set(unsigned int cols_i, unsigned int rows_i, float fovh)
+    {
+        f = float(cols_i)/(2.f*tan(0.5f*fovh));
+        inv_f = 1.f/f;
+        disp_u = 0.5f*float(cols_i-1);
+        disp_v = 0.5f*float(rows_i-1);
+    }
+
+    inline float x(float depth, int u) const { return (u - disp_u)*depth*inv_f; }
+    inline float y(float depth, int v) const { return (v - disp_v)*depth*inv_f; }
+};
+
+//Regular grid over the image plane used by the local (SLIC-like) clustering. There is one cluster seeded per cell
+//and every pixel is only compared with the clusters whose centers project into its cell or the 8 cells around it
+struct ClusterGrid
+{
+    unsigned int grid_rows, grid_cols;
+    float cell_h, cell_w;							//Size of the cells (in pixels) at the level being used
+    std::vector<unsigned int> row_cell, col_cell;	//Contribution of the row and the column of a pixel to the index of its cell
+    std::vector<std::vector<unsigned char> > candidates;	//Clusters to be considered for the pixels of every cell
+
+    void set(unsigned int rows_l, unsigned int cols_l)
+    {
+        grid_rows = std::max(1, int(round(sqrt(float(NUM_LABELS*rows_l)/float(cols_l)))));
+        grid_cols = (NUM_LABELS + grid_rows - 1)/grid_rows;
+        cell_h = float(rows_l)/float(grid_rows);
+        cell_w = float(cols_l)/float(grid_cols);
+
+        row_cell.resize(rows_l); col_cell.resize(cols_l);
+        for (unsigned int v=0; v<rows_l; v++)
+            row_cell[v] = std::min(grid_rows-1, (unsigned int)(v/cell_h));
+        for (unsigned int u=0; u<cols_l; u++)
+            col_cell[u] = std::min(grid_cols-1, (unsigned int)(u/cell_w))*grid_rows;
+    }
+
+    inline unsigned int cell(unsigned int v, unsigned int u) const { return col_cell[u] + row_cell[v]; }
+
+    //Label seeded in the cell of a pixel (the last cells are merged if NUM_LABELS is not a multiple of grid_rows)
+    inline unsigned int seedLabel(unsigned int v, unsigned int u) const { return std::min(cell(v,u), (unsigned int)(NUM_LABELS-1)); }
+
+    //Project the centers onto the image plane and gather the candidates of every cell (empty clusters are skipped)
+    void update(const Eigen::MatrixXf &centers, const LevelIntrinsics &intr, unsigned int rows_l, unsigned int cols_l)
+    {
+        set(rows_l, cols_l);
+        std::vector<std::vector<unsigned char> > in_cell(grid_rows*grid_cols);
+        for (unsigned int l=0; l<NUM_LABELS; l++)
+            if (centers(0,l) > 0.f)
+            {
+                const float u = intr.f*centers(1,l)/centers(0,l) + intr.disp_u;
+                const float v = intr.f*centers(2,l)/centers(0,l) + intr.disp_v;
+                const unsigned int v_cell = std::max(0.f, std::min(v, float(rows_l-1)));
+                const unsigned int u_cell = std::max(0.f, std::min(u, float(cols_l-1)));
+                in_cell[cell(v_cell, u_cell)].push_back(l);
+            }
+
+        candidates.assign(grid_rows*grid_cols, std::vector<unsigned char>());
+        for (int cu=0; cu<int(grid_cols); cu++)
+            for (int cv=0; cv<int(grid_rows); cv++)
+            {
+                std::vector<unsigned char> &cand = candidates[cu*grid_rows + cv];
+                for (int nu = std::max(0, cu-1); nu <= std::min(int(grid_cols)-1, cu+1); nu++)
+                    for (int nv = std::max(0, cv-1); nv <= std::min(int(grid_rows)-1, cv+1); nv++)
+                        cand.insert(cand.end(), in_cell[nu*grid_rows + nv].begin(), in_cell[nu*grid_rows + nv].end());
+            }
+    }
+
+    //Closest cluster among the candidates of the pixel (all the clusters are checked if there is none around)
+    inline unsigned int closestLabel(const Eigen::MatrixXf &centers, const Eigen::Vector3f &p, unsigned int v, unsigned int u) const
+    {
+        const std::vector<unsigned char> &cand = candidates[cell(v,u)];
+        unsigned int best_label = 0;
+        float best_distance = std::numeric_limits<float>::max();
+        if (cand.empty())
+        {
+            for (unsigned int l=0; l<NUM_LABELS; l++)
+                if (centers(0,l) > 0.f)
+                {
+                    const float distance = (centers.col(l) - p).squaredNorm();
+                    if (distance < best_distance) { best_distance = distance; best_label = l; }
+                }
+            return best_label;
+        }
+
+        for (size_t i=0; i<cand.size(); i++)
+        {
+            const float distance = (centers.col(cand[i]) - p).squaredNorm();
+            if (distance < best_distance) { best_distance = distance; best_label = cand[i]; }
+        }
+        return best_label;
+    }
+};
+
 
 class VO_SF {
 public:
@@ -71,12 +184,12 @@ public:
 	//----------------------------------------------------------------
     std::vector<Eigen::MatrixXf> intensity, intensity_old, intensity_inter, intensity_warped;	//Intensity images
     std::vector<Eigen::MatrixXf> depth, depth_old, depth_inter, depth_warped;					//Depth images
-	std::vector<Eigen::MatrixXf> xx, xx_inter, xx_old, xx_warped;								//x coordinates of points (proportional to the col index of the pixels)
-	std::vector<Eigen::MatrixXf> yy, yy_inter, yy_old, yy_warped;								//y coordinates of points (proportional to the row index of the pixels)
+	std::vector<LevelIntrinsics> intrinsics;													//Camera parameters of each level (the "xy" coordinates of the points are computed from them)
 
 	Eigen::MatrixXf depth_wf, intensity_wf;							//Original images read from the camera, dataset or file
     Eigen::MatrixXf dcu, dcv, dct;									//Gradients of the intensity images
     Eigen::MatrixXf ddu, ddv, ddt;									//Gradients of the depth images
+	Eigen::MatrixXf rx, ry, rx_intensity, ry_intensity;				//Weights used to compute the spatial gradients (scratch)
 	Eigen::MatrixXf im_r, im_g, im_b;								//Last color image used only for visualization
 	Eigen::MatrixXf im_r_old, im_g_old, im_b_old;					//Prev color image used only for visualization
     Eigen::MatrixXf weights_c, weights_d;							//Pre-weighting used in the solver
@@ -86,10 +199,28 @@ public:
 
     //Velocities, transformations and poses
 	Eigen::Matrix4f T_clusters[NUM_LABELS];					//Rigid transformations estimated for each cluster
+	Eigen::Matrix4f T_clusters_inv[NUM_LABELS];				//Inverse of T_clusters (computed before warping)
 	Eigen::Matrix4f T_odometry;								//Rigid transformation of the camera motion (odometry)
 	Vector6f twist_odometry, twist_level_odometry;			//Twist encoding the odometry (accumulated and local for the pyramid level)	
 	mrpt::poses::CPose3D cam_pose, cam_oldpose;				//Estimated camera poses (current and prev)
 
+	//Motion prior used to warm-start the coarse-to-fine solver
+	enum MotionPrior { PRIOR_NONE, PRIOR_CONSTANT_VELOCITY, PRIOR_EXTERNAL };
+	MotionPrior motion_prior;								//Initialization: identity, last estimate (constant velocity) or external prior
+	Eigen::Matrix4f T_odometry_prior;						//External prior for the camera motion (e.g. from wheel odometry)
+	bool prior_pending;										//A prior was given with setMotionPrior() and has not been used yet
+	Eigen::Matrix4f T_odometry_last, T_clusters_last[NUM_LABELS];	//Motions estimated in the last frame
+	bool last_motion_valid;									//Flag to know whether the last motions can be used
+
+	//Identity of the clusters across frames (used to warm-start their motions)
+	bool use_cluster_tracking;								//Flag to match the clusters with the last ones and warm-start them with their last motion
+	Eigen::Matrix<float, 3, NUM_LABELS> kmeans_last;		//Centers of the clusters in the last frame
+	Eigen::Matrix<int, NUM_LABELS, 1> size_kmeans_last;
+	bool last_clusters_valid;								//Flag to know whether the last clusters can be used (false after odometry-only frames)
+	int cluster_match[NUM_LABELS];							//Cluster of the last frame matched to every cluster (-1 if none)
+	void trackClusters();									//Match the clusters with the last ones moved with their last motion
+	bool warmStartTrackedClusters();						//Initialize T_clusters of the tracked dynamic clusters (returns false if none)
+
 	//Parameters
     float fovh, fovv;							//Field of view of the camera (intrinsic calibration)
     unsigned int rows, cols;					//Max resolution used for the solver (240 x 320 by default)
@@ -101,22 +232,53 @@ public:
 
     VO_SF(unsigned int res_factor);
     void createImagePyramid();					//Create image pyramids (intensity and depth)
+	void computeCoordinates(const Eigen::MatrixXf &depth_in, unsigned int pyr_level, Eigen::MatrixXf &x, Eigen::MatrixXf &y) const;	//Coordinates "xy" of a depth image (only needed for visualization)
     void warpImages();							//Fast warping (last image towards the prev one)
     void warpImagesParallel();
     void warpImages(cv::Rect region);
+	void warpPixel(unsigned int i, unsigned int j, const LevelIntrinsics &intr, float &c, float &d);	//Fast warping of a single pixel
 	void warpImagesAccurate();					//Accurate warping (last image towards the prev one)
     void calculateCoord();						//Compute so-called "intermediate coordinates", related to a more precise linearization of optical and range flow
 	void computeCoordsParallel();
     void calculateCoord(cv::Rect region);
 	void calculateDerivatives();				//Compute the image gradients
+	void calculateGradientWeights(cv::Rect region);
+	void calculateDerivatives(cv::Rect region);
+	void computeIdentityLevelProducts();		//Inter coords and derivatives of the coarsest level with no motion (computed once per frame)
+	bool identity_warp;							//Flag to read the new images instead of the warped ones (no motion, avoids copying them)
+	bool identity_level_valid;					//Flag to know whether the products below correspond to the current images
+	Eigen::MatrixXf identity_depth_inter, identity_intensity_inter;		//Products of the coarsest level with no motion (shared by both passes)
+	Eigen::MatrixXf identity_dcu, identity_dcv, identity_dct, identity_ddu, identity_ddv, identity_ddt;
+	Eigen::Matrix<bool, Eigen::Dynamic, Eigen::Dynamic> identity_Null;
     void computeWeights();						//Compute pre-weighting functions for the solver
+	void computeWeights(cv::Rect region);
 	void computeSceneFlowFromRigidMotions();	//Compute dense scene flow from rigid motions
+	void computeSceneFlowFromRigidMotions(size_t first, size_t last);
+	std::vector<int> scene_flow_pixels;			//Pixels whose scene flow is computed (dynamic clusters or connected to them)
 	void updateCameraPoseFromOdometry();		//Update the camera pose
 	void computeTransformationFromTwist(Vector6f &twist, bool is_odometry, unsigned int label = 0);	//Compute rigid transformation from twist
 	void interpolateColorAndDepthAcu(float &c, float &d, const float ind_u, const float ind_v);		//Interpolate in images (necessary for warping)
 
+	void setMotionPrior(const Eigen::Matrix4f &T);		//Set the prior for the next frame only (same convention as T_odometry)
+	bool initializeMotionFromPrior();			//Initialize T_odometry and T_clusters (returns false if they are set to identity)
+
     void run_VO_SF(bool create_image_pyr);		//Main method to run whole algorithm
 
+	//Gating of the stages for (almost) static frames
+	enum FrameReuse { REUSE_NONE, REUSE_CLUSTERS, REUSE_SEGMENTATION };
+	bool use_motion_gating;						//Flag to reuse the last clusters (and segmentation) when the images barely change
+	float gating_depth_threshold;				//Mean depth difference (meters) at the coarsest level below which the clusters are reused
+	float gating_intensity_threshold;			//Mean intensity difference at the coarsest level below which the clusters are reused
+	float gating_segmentation_ratio;			//Fraction of the thresholds below which the segmentation is reused too
+	unsigned int gated_frames, gated_clusters_reused, gated_segmentation_reused;	//Counters of the frames and the shortcuts taken
+	Eigen::MatrixXf gating_depth_clustered, gating_intensity_clustered;	//Coarsest level of the images the current clusters were computed on
+	FrameReuse gateFrame();						//Compare the coarsest level of the images with the clustered ones and decide what can be reused
+	void runStages(FrameReuse reuse);			//Clustering, segmentation and motion estimation (skipping the stages that can be reused)
+
+	bool odometry_only;							//Flag to run only the robust odometry (no clustering, segmentation or scene flow)
+	bool odometry_only_reuse_segm;				//Flag to downweight the pixels that were dynamic in the last full estimate (odometry only)
+	void saveLastMotion();						//Store the motions estimated to warm-start the next frame
+
     void run_VO_SF_TP ( bool create_image_pyr );		//Main method to run whole algorithm (Tim Patten version)
 
 
@@ -129,29 +291,73 @@ public:
 	float irls_chi2_decrement_threshold;	//Convergence threshold for the IRLS solver (change in chi2)	
 	float irls_delta_threshold;				//Convergence threshold for the IRLS solver (change in the solution)	
 	SolveForMotionWorkspace ws_foreground, ws_background;		//Structures for efficient solver
+	bool recompute_jacobians_irls;			//Flag to recompute the Jacobians at every IRLS iteration instead of storing them (A and B). Slower, only saves memory
+	JacobianStorage jacobianStorage() const;	//Storage of the Jacobians selected by the flag above
+
+	//Residuals used by the solver (the single-residual modes use 1-row Jacobians)
+	enum ResidualMode { RESIDUALS_BOTH, RESIDUALS_GEOMETRIC, RESIDUALS_PHOTOMETRIC };
+	ResidualMode residual_mode;				//Both residuals, depth only (e.g. dark scenes or IR-only sensors) or intensity only
+
+	bool use_pixel_selection;				//Flag to turn on/off the selection of informative pixels for the solver
+	unsigned int max_pixels_per_cluster;	//Max number of pixels per cluster and level when the selection is on
+	Eigen::Matrix<bool, Eigen::Dynamic, Eigen::Dynamic> pixel_selected;	//Mask of the pixels selected for the solver
+
+	void selectInformativePixels(bool use_weights);	//Pick a bounded and spatially distributed subset of pixels with high gradients
 
 	//Estimate rigid motion for a set of pixels (given their indices)
 	void solveMotionForIndices(std::vector<std::pair<int, int> > const&indices, Vector6f &twist, SolveForMotionWorkspace &ws, bool is_background);	
+	template<int Rows> void solveMotionForIndices(std::vector<std::pair<int, int> > const&indices, Vector6f &twist, SolveForMotionWorkspace &ws, bool is_background);
 	void solveMotionDynamicClusters();			//Estimate motion of dynamic clusters
 	void solveMotionStaticClusters();			//Estimate motion of static clusters
     void solveMotionAllClusters();				//Estimate motion after knowing the segmentation
+	void solveMotionAllClustersSingleSweep();	//Same as above, but all the clusters are accumulated in a single sweep over the pixels
+	bool use_single_sweep_clusters;				//Flag to use the single-sweep version of the multi-cluster solver
 	void solveRobustOdometryCauchy();			//Estimate robust odometry before knowing the segmentation
+	template<int Rows> void solveRobustOdometryCauchy();
+	void solveRobustOdometryCoarseToFine();		//Coarse-to-fine robust odometry (first pass)
+	void solveMultiOdometryCoarseToFine();		//Coarse-to-fine motion estimation for every cluster (second pass)
 
 	
 
     //					Geometric clustering
     //--------------------------------------------------------------   
-	std::vector<Eigen::MatrixXi> labels;											//Integer non-smooth labelling
+	std::vector<MatrixLabels> labels;												//Integer non-smooth labelling
     std::vector<Eigen::Matrix<float, NUM_LABELS+1, Eigen::Dynamic> > label_funct;	//Indicator funtions for the continuous labelling
 	Eigen::Matrix<float, 3, NUM_LABELS> kmeans;										//Centers of the KMeans clusters
 	Eigen::Matrix<int, NUM_LABELS, 1> size_kmeans;									//Size of the clusters
 	bool connectivity[NUM_LABELS][NUM_LABELS];										//Connectivity between the clusters
 
 	void createLabelsPyramidUsingKMeans();				//Create the label pyramid
+	void createLabelsPyramidByDownsampling();			//Create the label pyramid by downsampling the labelling functions level by level
+	void downsampleLabels(unsigned int level_ctf, unsigned int first_col, unsigned int last_col);
+	bool label_pyramid_by_downsampling;					//Flag to choose between the two methods above
+	bool use_local_clustering;							//Flag to search only the clusters seeded around every pixel (SLIC-like, the cost does not grow with NUM_LABELS)
+	ClusterGrid cluster_grid;							//Grid of the local clustering
 	void initializeKMeans();							//Initialize KMeans by uniformly dividing the image plane
 	void kMeans3DCoord();								//Segment the scene in clusters using the 3D coordinates of the points				
-    void computeRegionConnectivity();					//Compute connectivity graph (which cluster is contiguous to which)
+	bool use_incremental_clustering;					//Flag to re-cluster only the tiles that changed since the last frame (after compensating the camera motion)
+	unsigned int max_frames_incremental;				//Consecutive incremental updates before clustering everything again
+	unsigned int clustering_tile_size;					//Size (in pixels) of the tiles of the incremental clustering
+	bool incrementalKMeans3DCoord();					//Returns false if the incremental update can't be used (a full clustering is needed)
+	void propagateLabels(size_t first_tile, size_t last_tile);		//Warp the last labels to the new image and reassign the pixels that changed
+	void smoothChangedTiles(size_t first_tile, size_t last_tile);
+	void saveClusteringState();							//Store the images and labels used by the next incremental update
+	Eigen::MatrixXf depth_clustered, intensity_clustered;					//Images of the last clustering
+	MatrixLabels labels_last;												//Labels of the last clustering (swapped with the current ones)
+	Eigen::Matrix<float, NUM_LABELS+1, Eigen::Dynamic> label_funct_last;	//Labelling functions of the last clustering
+	std::vector<unsigned char> tile_state;
+	bool clustering_state_valid;
+	unsigned int frames_incremental;
     void smoothRegions(unsigned int image_level);		//Smooth/blend clusters for a better scene flow estimation
+	void smoothRegions(unsigned int image_level, unsigned int first_col, unsigned int last_col);
+	void smoothRegions(unsigned int image_level, cv::Rect region);
+	float exp_table[EXP_TABLE_SIZE+1];					//Lookup table for exp(-x) with x in [0, 6) (used to smooth the regions)
+	inline float fastNegExp(float x) const				//exp(-x) for x in [0, 6), linear interpolation in the table
+	{
+		const float ind = x*(EXP_TABLE_SIZE/6.f);
+		const int i = int(ind);
+		return exp_table[i] + (ind - float(i))*(exp_table[i+1] - exp_table[i]);
+	}
 
 
 
@@ -160,11 +366,18 @@ public:
 	Eigen::Matrix<bool, NUM_LABELS, 1> label_static, label_dynamic;			//Cluster segmentation as static, dynamic or both (uncertain)
 	Eigen::Matrix<float, NUM_LABELS, 1> b_segm, b_segm_warped;				//Exact b values of the segmentation (original and warped)
 	Eigen::MatrixXf b_segm_image_warped;									//Per-pixel static-dynamic segmentation (value of b per pixel, used for temporal propagation)
+	Eigen::Matrix<float, NUM_LABELS, 1> b_segm_sum;							//Sum of b_segm_image_warped over every cluster (accumulated by kMeans3DCoord)
 	bool use_b_temp_reg;													//Flag to turn on/off temporal propagation of the static/dynamic segmentation
+	bool use_single_pass;													//Flag to skip the robust odometry pass when the warped segmentation is reliable
+	float single_pass_max_uncertain;										//Max fraction of the pixels in uncertain clusters to trust the warped segmentation
+	unsigned int single_pass_frames, two_pass_frames;						//Counters of the frames solved with one or two passes
 
 	void segmentStaticDynamic();											//Main method to segment the clusters into static/dynamic
 	void optimizeSegmentation(Eigen::Matrix<float, NUM_LABELS, 1> &r);		//Solver the optimization problem proposed for the segmentation
+	void classifyClusters();												//Set label_static and label_dynamic from b_segm
+	bool segmentStaticDynamicFromTemporal();								//Take the warped segmentation as it is (returns false if it is not reliable)
 	void warpStaticDynamicSegmentation();									//Warp the segmentation forward
+	void warpStaticDynamicSegmentationWithOdometry();						//Warp the per-pixel segmentation forward with the camera motion only
 	void computeSegTemporalRegValues();										//Compute ref values for the temporal regularization
 
 
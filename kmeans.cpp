@@ -22,6 +22,7 @@
 *********************************************************************************/
 
 #include <joint_vo_sf.h>
+#include <structs_parallelization.h>
 
 using namespace mrpt;
 using namespace mrpt::utils;
@@ -29,58 +30,64 @@ using namespace std;
 using namespace Eigen;
 
 
-struct IndexAndDistance
-{
-    int idx;
-    float distance;
-
-    bool operator<(const IndexAndDistance &o) const
-    {
-        return distance < o.distance;
-    }
-};
-
 void VO_SF::initializeKMeans()
 {
 	//Initialization: kmeans are computed at one resolution lower than the max (to speed the process up)
 	rows_i = rows/2; cols_i = cols/2; 
 	image_level = round(log2(width/cols_i));
 	const MatrixXf &depth_ref = depth_old[image_level];
-	const MatrixXf &xx_ref = xx_old[image_level];
-	const MatrixXf &yy_ref = yy_old[image_level];
-	MatrixXi &labels_ref = labels[image_level];
-	labels_ref.assign(NUM_LABELS);
+	MatrixLabels &labels_ref = labels[image_level];
+	labels_ref.setConstant(NUM_LABELS);
 
 
 	//Initialize from scratch at every iteration
 	//-------------------------------------------------------------
 	//Create seeds for the k-means by dividing the image domain
 	unsigned int u_label[NUM_LABELS], v_label[NUM_LABELS];
-	const unsigned int vert_div = ceil(sqrt(NUM_LABELS));
-	const float u_div = float(cols_i)/float(NUM_LABELS+1);
-	const float v_div = float(rows_i)/float(vert_div+1); 
-	for (unsigned int i=0; i<NUM_LABELS; i++)
+	if (use_local_clustering)
 	{
-		u_label[i] = round((i + 1)*u_div);
-		v_label[i] = round((i%vert_div + 1)*v_div);
+		//One seed at the center of every cell of the grid (its cells are the regions of the seeds)
+		cluster_grid.set(rows_i, cols_i);
+		for (unsigned int i=0; i<NUM_LABELS; i++)
+		{
+			u_label[i] = round(((i/cluster_grid.grid_rows) + 0.5f)*cluster_grid.cell_w);
+			v_label[i] = round(((i%cluster_grid.grid_rows) + 0.5f)*cluster_grid.cell_h);
+		}
+
+		for (unsigned int u=0; u<cols_i; u++)
+			for (unsigned int v=0; v<rows_i; v++)
+				if (depth_ref(v,u) != 0.f)
+					labels_ref(v,u) = cluster_grid.seedLabel(v,u);
 	}
+	else
+	{
+		const unsigned int vert_div = ceil(sqrt(NUM_LABELS));
+		const float u_div = float(cols_i)/float(NUM_LABELS+1);
+		const float v_div = float(rows_i)/float(vert_div+1); 
+		for (unsigned int i=0; i<NUM_LABELS; i++)
+		{
+			u_label[i] = round((i + 1)*u_div);
+			v_label[i] = round((i%vert_div + 1)*v_div);
+		}
 
-	//Compute the coordinates associated to the initial seeds
-	for (unsigned int u=0; u<cols_i; u++)
-		for (unsigned int v=0; v<rows_i; v++)
-			if (depth_ref(v,u) != 0.f)
-			{
-				unsigned int min_dist = 1000000.f, quad_dist;
-				unsigned int ini_label = NUM_LABELS;
-				for (unsigned int l=0; l<NUM_LABELS; l++)
-					if ((quad_dist = square(v - v_label[l]) + square(u - u_label[l])) < min_dist)
-					{
-						ini_label = l;
-						min_dist = quad_dist;
-					}
+		//Compute the coordinates associated to the initial seeds
+		for (unsigned int u=0; u<cols_i; u++)
+			for (unsigned int v=0; v<rows_i; v++)
+				if (depth_ref(v,u) != 0.f)
+				{
+					unsigned int min_dist = 1000000.f, quad_dist;
+					unsigned int ini_label = NUM_LABELS;
+					for (unsigned int l=0; l<NUM_LABELS; l++)
+						if ((quad_dist = square(v - v_label[l]) + square(u - u_label[l])) < min_dist)
+						{
+							ini_label = l;
+							min_dist = quad_dist;
+						}
+
+					labels_ref(v,u) = ini_label;
+				}
+	}
 
-				labels_ref(v,u) = ini_label;
-			}
 
 	//Compute the "center of mass" for each region
 	std::vector<float> depth_sorted[NUM_LABELS];
@@ -125,9 +132,12 @@ void VO_SF::kMeans3DCoord()
 
 	//Refs
 	const MatrixXf &depth_ref = depth_old[lower_level];
-	const MatrixXf &xx_ref = xx_old[lower_level];
-	const MatrixXf &yy_ref = yy_old[lower_level];
-	MatrixXi &labels_lowres = labels[lower_level];
+	const LevelIntrinsics &intr_lowres = intrinsics[lower_level];
+	MatrixLabels &labels_lowres = labels[lower_level];
+
+	//Incremental mode: only the tiles that changed since the last frame are processed
+	if (use_incremental_clustering && incrementalKMeans3DCoord())
+		return;
 
 	//Initialization
 	initializeKMeans();
@@ -149,54 +159,73 @@ void VO_SF::kMeans3DCoord()
     for (unsigned int i=0; i<iter_kmeans-1; i++)
     {
         centers_b.setZero();
-
-		//Compute and sort distances between the kmeans
         for (unsigned int l=0; l<NUM_LABELS; l++)
-        {
             count[l] = 0;
-			vector<IndexAndDistance> &distances = cluster_distances.at(l);
-            for (unsigned int li=0; li<NUM_LABELS; li++)
-            {
-                IndexAndDistance &idx_and_distance = distances.at(li);
-                idx_and_distance.idx = li;
-                idx_and_distance.distance = (centers_a.col(l) - centers_a.col(li)).squaredNorm();
-            }
-            std::sort(distances.begin(), distances.end());
-        }
-
 
-        //Compute belonging to each label
-        for (unsigned int u=0; u<cols_i; u++)
-            for (unsigned int v=0; v<rows_i; v++)
-                if (depth_ref(v,u) != 0.f)
+		//Local clustering: only the clusters around every pixel are considered
+		if (use_local_clustering)
+		{
+			cluster_grid.update(centers_a, intr_lowres, rows_i, cols_i);
+			for (unsigned int u=0; u<cols_i; u++)
+				for (unsigned int v=0; v<rows_i; v++)
+					if (depth_ref(v,u) != 0.f)
+					{
+						const Vector3f p(depth_ref(v,u), intr_lowres.x(depth_ref(v,u), u), intr_lowres.y(depth_ref(v,u), v));
+						const unsigned int best_label = cluster_grid.closestLabel(centers_a, p, v, u);
+						labels_lowres(v,u) = best_label;
+						centers_b.col(best_label) += p;
+						count[best_label] += 1;
+					}
+		}
+		else
+		{
+			//Compute and sort distances between the kmeans
+            for (unsigned int l=0; l<NUM_LABELS; l++)
+            {
+				vector<IndexAndDistance> &distances = cluster_distances.at(l);
+                for (unsigned int li=0; li<NUM_LABELS; li++)
                 {
-                    //Initialize
-					const int last_label = labels_lowres(v,u);
-					int best_label = last_label;
-                    vector<IndexAndDistance> &distances = cluster_distances.at(last_label);
+                    IndexAndDistance &idx_and_distance = distances.at(li);
+                    idx_and_distance.idx = li;
+                    idx_and_distance.distance = (centers_a.col(l) - centers_a.col(li)).squaredNorm();
+                }
+                std::sort(distances.begin(), distances.end());
+            }
 
-                    const Vector3f p(depth_ref(v,u), xx_ref(v,u), yy_ref(v,u));
-                    const float distance_to_last_label = (centers_a.col(last_label) - p).squaredNorm();
-                    float best_distance = distance_to_last_label;
 
-                    for (size_t li = 1; li < distances.size(); ++li)
+            //Compute belonging to each label
+            for (unsigned int u=0; u<cols_i; u++)
+                for (unsigned int v=0; v<rows_i; v++)
+                    if (depth_ref(v,u) != 0.f)
                     {
-                        const IndexAndDistance &idx_and_distance = distances.at(li);
-                        if(idx_and_distance.distance > 4.f*distance_to_last_label) break;
+                        //Initialize
+						const int last_label = labels_lowres(v,u);
+						int best_label = last_label;
+                        vector<IndexAndDistance> &distances = cluster_distances.at(last_label);
 
-                        const float distance_to_label = (centers_a.col(idx_and_distance.idx) - p).squaredNorm();
+                        const Vector3f p(depth_ref(v,u), intr_lowres.x(depth_ref(v,u), u), intr_lowres.y(depth_ref(v,u), v));
+                        const float distance_to_last_label = (centers_a.col(last_label) - p).squaredNorm();
+                        float best_distance = distance_to_last_label;
 
-                        if(distance_to_label < best_distance)
+                        for (size_t li = 1; li < distances.size(); ++li)
                         {
-                            best_distance = distance_to_label;
-                            best_label = idx_and_distance.idx;
+                            const IndexAndDistance &idx_and_distance = distances.at(li);
+                            if(idx_and_distance.distance > 4.f*distance_to_last_label) break;
+
+                            const float distance_to_label = (centers_a.col(idx_and_distance.idx) - p).squaredNorm();
+
+                            if(distance_to_label < best_distance)
+                            {
+                                best_distance = distance_to_label;
+                                best_label = idx_and_distance.idx;
+                            }
                         }
-                    }
 
-                    labels_lowres(v,u) = best_label;
-                    centers_b.col(best_label) += p;
-                    count[best_label] += 1;
-                }
+                        labels_lowres(v,u) = best_label;
+                        centers_b.col(best_label) += p;
+                        count[best_label] += 1;
+	                }
+		}
 
         for (unsigned int l=0; l<NUM_LABELS; l++)
             if (count[l] > 0)
@@ -219,153 +248,256 @@ void VO_SF::kMeans3DCoord()
 
     //      Compute the labelling functions at the max resolution (rows,cols)
     //------------------------------------------------------------------------------------
-	const MatrixXf &depth_highres = depth_old[max_level];
-	const MatrixXf &xx_highres = xx_old[max_level];
-	const MatrixXf &yy_highres = yy_old[max_level];
-	MatrixXi &labels_ref = labels[max_level];
+	//Labels, sizes, connectivity and temporal-regularization sums are obtained in a single parallel sweep
+	if (use_local_clustering)
+		cluster_grid.update(centers_a, intrinsics[max_level], rows, cols);
 
-	//Initialize labels
-	labels_ref.assign(NUM_LABELS);
-	for(int i = 0; i < NUM_LABELS; ++i)
-		count[i] = 0;
+	ClusterStatisticsFn fn(*this, centers_a, cluster_distances, use_local_clustering ? &cluster_grid : NULL, max_level);
+	const ClusterStatistics stats = tbb::parallel_reduce(tbb::blocked_range<unsigned int>(0, cols, 8), ClusterStatistics(), fn, ClusterStatistics::Reduce());
 
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+	{
+		size_kmeans[l] = stats.count[l];
+		b_segm_sum[l] = stats.b_sum[l];
+		for (unsigned int lc=0; lc<NUM_LABELS; lc++)
+			connectivity[l][lc] = stats.adjacency[l][lc];
+	}
 
-    //Find the closest kmean and set the corresponding label to 1
-    for (unsigned int u=0; u<cols; u++)
-        for (unsigned int v=0; v<rows; v++)
-            if (depth_highres(v,u) != 0.f)
-            {
-                const int label_lowres_here = labels_lowres(v/2,u/2);
-				const int last_label = (label_lowres_here == NUM_LABELS) ? 0 : label_lowres_here; //If it was invalid in the low res level initialize it randomly (at 0)
+    //Smooth regions
+	rows_i = rows; cols_i = cols;
+    smoothRegions(max_level);
 
-                int best_label = last_label;
-                vector<IndexAndDistance> &distances = cluster_distances.at(last_label);
-                const Vector3f p(depth_highres(v,u), xx_highres(v,u), yy_highres(v,u));
+	frames_incremental = 0;
+	saveClusteringState();
+}
 
-                const float distance_to_last_label = (centers_a.col(last_label) - p).squaredNorm();
-                float best_distance = distance_to_last_label;
+bool VO_SF::incrementalKMeans3DCoord()
+{
+	const unsigned int max_level = round(log2(width/cols));
+	const float max_dirty_tiles = 0.5f;		//Above this fraction it is cheaper to cluster everything again
 
-                for(size_t li = 1; li < distances.size(); ++li)
-                {
-                    const IndexAndDistance &idx_and_distance = distances.at(li);
-                    if(idx_and_distance.distance > 4.f*distance_to_last_label) break;
+	if (!clustering_state_valid || (frames_incremental >= max_frames_incremental))
+		return false;
 
-                    const float distance_to_label = (centers_a.col(idx_and_distance.idx) - p).squaredNorm();
+	//Move the centers with the camera motion estimated in the last frame (T_odometry goes from the new frame to the old one)
+	const Matrix4f T_inv = se3::inverse(T_odometry);
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		if (kmeans(0,l) != 0.f)
+			kmeans.col(l) = T_inv.block<3,3>(0,0)*kmeans.col(l) + T_inv.block<3,1>(0,3);
 
-                    if(distance_to_label < best_distance)
-                    {
-                        best_distance = distance_to_label;
-                        best_label = idx_and_distance.idx;
-                    }
-                }
-                labels_ref(v,u) = best_label;
-				count[best_label]++;
-            }
+	//Keep the last labels to warp them (all the pixels of the new ones are written)
+	labels[max_level].swap(labels_last);
+	label_funct[max_level].swap(label_funct_last);
 
-    //Compute connectivity
-    computeRegionConnectivity();
+	//Warp the labels to the clean tiles and reassign the pixels that changed
+	const unsigned int num_tiles = ((rows + clustering_tile_size - 1)/clustering_tile_size)*((cols + clustering_tile_size - 1)/clustering_tile_size);
+	tile_state.resize(num_tiles);
+	VO_SF_RangeFunctor<&VO_SF::propagateLabels> propagate(*this);
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, num_tiles, 4), propagate);
 
-    //Smooth regions
-	rows_i = rows; cols_i = cols;
-    smoothRegions(max_level);
+	unsigned int num_dirty = 0;
+	for (unsigned int t=0; t<num_tiles; t++)
+		if (tile_state[t] == TILE_DIRTY)
+			num_dirty++;
+
+	if (num_dirty > max_dirty_tiles*num_tiles)
+	{
+		labels[max_level].swap(labels_last);
+		label_funct[max_level].swap(label_funct_last);
+		return false;
+	}
+
+	//Sizes, connectivity, temporal-regularization sums and centers of the new labelling
+	ClusterStatisticsFn fn(*this, max_level);
+	const ClusterStatistics stats = tbb::parallel_reduce(tbb::blocked_range<unsigned int>(0, cols, 8), ClusterStatistics(), fn, ClusterStatistics::Reduce());
 
-	//Save the size of each segment (at max resolution)
 	for (unsigned int l=0; l<NUM_LABELS; l++)
-		size_kmeans[l] = count[l];
+	{
+		size_kmeans[l] = stats.count[l];
+		b_segm_sum[l] = stats.b_sum[l];
+		for (unsigned int lc=0; lc<NUM_LABELS; lc++)
+			connectivity[l][lc] = stats.adjacency[l][lc];
+
+		if (stats.count[l] > 0)
+			for (unsigned int c=0; c<3; c++)
+				kmeans(c,l) = stats.coord_sum[l][c]/stats.count[l];
+	}
+
+	//Smooth the tiles whose labels changed (the labelling functions of the rest were warped)
+	VO_SF_RangeFunctor<&VO_SF::smoothChangedTiles> smooth(*this);
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, num_tiles, 4), smooth);
+
+	rows_i = rows; cols_i = cols;
+	frames_incremental++;
+	saveClusteringState();
+	return true;
 }
 
-void VO_SF::computeRegionConnectivity()
+void VO_SF::propagateLabels(size_t first_tile, size_t last_tile)
 {
-    const unsigned int max_level = round(log2(width/cols));
-    const float dist2_threshold = square(0.03f*120.f/float(rows));
+	const unsigned int max_level = round(log2(width/cols));
+	const unsigned int tiles_per_col = (rows + clustering_tile_size - 1)/clustering_tile_size;
+	const float max_depth_dif = 0.05f, max_intensity_dif = 0.1f;
+	const float max_dirty_pixels = 0.1f;
 
 	//Refs
-	const MatrixXi &labels_ref = labels[max_level];
-	const MatrixXf &depth_old_ref = depth_old[max_level];
-	const MatrixXf &xx_old_ref = xx_old[max_level];
-	const MatrixXf &yy_old_ref = yy_old[max_level];
+	const MatrixXf &depth_ref = depth_old[max_level];
+	const MatrixXf &intensity_ref = intensity_old[max_level];
+	const LevelIntrinsics &intr = intrinsics[max_level];
+	MatrixLabels &labels_ref = labels[max_level];
+	Matrix<float, NUM_LABELS+1, Dynamic> &label_funct_ref = label_funct[max_level];
+
+	Matrix<float, NUM_LABELS+1, 1> no_label; no_label.fill(0.f); no_label(NUM_LABELS) = 1.f;
+
+	for (size_t t=first_tile; t<last_tile; t++)
+	{
+		const unsigned int v_ini = (t%tiles_per_col)*clustering_tile_size, v_end = min(rows, v_ini + clustering_tile_size);
+		const unsigned int u_ini = (t/tiles_per_col)*clustering_tile_size, u_end = min(cols, u_ini + clustering_tile_size);
+		unsigned int num_valid = 0, num_changed = 0;
 
-    for (unsigned int i=0; i<NUM_LABELS; i++)
-        for (unsigned int j=0; j<NUM_LABELS; j++)
+		//Look for the pixel of the last clustered image that every point comes from (nearest neighbour)
+		for (unsigned int u=u_ini; u<u_end; u++)
+			for (unsigned int v=v_ini; v<v_end; v++)
+			{
+				const unsigned int pixel_ind = v+u*rows;
+				const float z = depth_ref(v,u);
+				labels_ref(v,u) = NUM_LABELS;
+				if (z == 0.f)
+				{
+					label_funct_ref.col(pixel_ind) = no_label;
+					continue;
+				}
+
+				num_valid++;
+				const float x = intr.x(z, u), y = intr.y(z, v);
+				const float depth_w = T_odometry(0)*z + T_odometry(4)*x + T_odometry(8)*y + T_odometry(12);
+				const float x_w = T_odometry(1)*z + T_odometry(5)*x + T_odometry(9)*y + T_odometry(13);
+				const float y_w = T_odometry(2)*z + T_odometry(6)*x + T_odometry(10)*y + T_odometry(14);
+				if (depth_w <= 0.f)
+				{
+					num_changed++;
+					continue;
+				}
+
+				const int uwarp = int(round(intr.f*x_w/depth_w + intr.disp_u));
+				const int vwarp = int(round(intr.f*y_w/depth_w + intr.disp_v));
+				if ((uwarp >= 0)&&(uwarp < int(cols))&&(vwarp >= 0)&&(vwarp < int(rows))
+					&&(labels_last(vwarp,uwarp) != NUM_LABELS)
+					&&(abs(depth_clustered(vwarp,uwarp) - depth_w) < max_depth_dif)
+					&&(abs(intensity_clustered(vwarp,uwarp) - intensity_ref(v,u)) < max_intensity_dif))
+				{
+					labels_ref(v,u) = labels_last(vwarp,uwarp);
+					label_funct_ref.col(pixel_ind) = label_funct_last.col(vwarp + uwarp*rows);
+				}
+				else
+					num_changed++;
+			}
+
+		if (num_changed == 0)
 		{
-			if (i == j) connectivity[i][j] = true;
-			else		connectivity[i][j] = false;
+			tile_state[t] = TILE_CLEAN;
+			continue;
 		}
 
-    for (unsigned int u=0; u<cols-1; u++)
-        for (unsigned int v=0; v<rows-1; v++)					
-			if (depth_old_ref(v,u) != 0.f)
-            {
-                //Detect change in the labelling (v+1,u)
-                if ((labels_ref(v,u) != labels_ref(v+1,u))&&(labels_ref(v+1,u) != NUM_LABELS))
-                {
-                    const float disty = square(depth_old_ref(v,u) - depth_old_ref(v+1,u)) + square(yy_old_ref(v,u) - yy_old_ref(v+1,u));
-                    if (disty < dist2_threshold)
-                    {
-                        connectivity[labels_ref(v,u)][labels_ref(v+1,u)] = true;
-                        connectivity[labels_ref(v+1,u)][labels_ref(v,u)] = true;
-                    }
-                }
+		//Reassign the pixels that changed (or the whole tile if many of them did)
+		tile_state[t] = (num_changed > max_dirty_pixels*num_valid) ? TILE_DIRTY : TILE_PARTIALLY_DIRTY;
+		for (unsigned int u=u_ini; u<u_end; u++)
+			for (unsigned int v=v_ini; v<v_end; v++)
+				if ((depth_ref(v,u) != 0.f)&&((labels_ref(v,u) == NUM_LABELS)||(tile_state[t] == TILE_DIRTY)))
+				{
+					const Vector3f p(depth_ref(v,u), intr.x(depth_ref(v,u), u), intr.y(depth_ref(v,u), v));
+					unsigned int best_label;
+					(kmeans.colwise() - p).colwise().squaredNorm().minCoeff(&best_label);
+					labels_ref(v,u) = best_label;
+				}
+	}
+}
 
-                //Detect change in the labelling (v,u+1)
-                if ((labels_ref(v,u) != labels_ref(v,u+1))&&(labels_ref(v,u+1) != NUM_LABELS))
-                {
-                    const float distx = square(depth_old_ref(v,u) - depth_old_ref(v,u+1)) + square(xx_old_ref(v,u) - xx_old_ref(v,u+1));
-                    if (distx < dist2_threshold)
-                    {
-                        connectivity[labels_ref(v,u)][labels_ref(v,u+1)] = true;
-                        connectivity[labels_ref(v,u+1)][labels_ref(v,u)] = true;
-                    }
-                }
-            }
+void VO_SF::smoothChangedTiles(size_t first_tile, size_t last_tile)
+{
+	const unsigned int max_level = round(log2(width/cols));
+	const unsigned int tiles_per_col = (rows + clustering_tile_size - 1)/clustering_tile_size;
+
+	for (size_t t=first_tile; t<last_tile; t++)
+		if (tile_state[t] != TILE_CLEAN)
+		{
+			const unsigned int v_ini = (t%tiles_per_col)*clustering_tile_size, v_end = min(rows, v_ini + clustering_tile_size);
+			const unsigned int u_ini = (t/tiles_per_col)*clustering_tile_size, u_end = min(cols, u_ini + clustering_tile_size);
+			smoothRegions(max_level, cv::Rect(u_ini, v_ini, u_end - u_ini, v_end - v_ini));
+		}
+}
+
+void VO_SF::saveClusteringState()
+{
+	if (!use_incremental_clustering)
+		return;
+
+	const unsigned int max_level = round(log2(width/cols));
+	depth_clustered = depth_old[max_level];
+	intensity_clustered = intensity_old[max_level];
+	if (labels_last.rows() != labels[max_level].rows() || labels_last.cols() != labels[max_level].cols())
+	{
+		labels_last.resize(rows, cols);
+		label_funct_last.resize(NUM_LABELS+1, rows*cols);
+	}
+	clustering_state_valid = true;
 }
 
 void VO_SF::smoothRegions(unsigned int image_level)
+{
+	//Every column of label_funct is fully written (no need to clear it first)
+	SmoothRegionsFn fn(*this, image_level);
+	tbb::parallel_for(tbb::blocked_range<unsigned int>(0, cols_i, 8), fn);
+}
+
+void VO_SF::smoothRegions(unsigned int image_level, unsigned int first_col, unsigned int last_col)
+{
+	smoothRegions(image_level, cv::Rect(first_col, 0, last_col - first_col, depth_old[image_level].rows()));
+}
+
+void VO_SF::smoothRegions(unsigned int image_level, cv::Rect region)
 {
 	//Refs
 	const MatrixXf &depth_ref = depth_old[image_level];
-	const MatrixXf &xx_ref = xx_old[image_level];
-	const MatrixXf &yy_ref = yy_old[image_level];
-	const MatrixXi &labels_ref = labels[image_level];
+	const LevelIntrinsics &intr = intrinsics[image_level];
+	const MatrixLabels &labels_ref = labels[image_level];
 	Matrix<float, NUM_LABELS+1, Dynamic> &label_funct_ref = label_funct[image_level];
-
-    //Set all labelling functions to zero initially
-    label_funct_ref.assign(0.f);
+	const unsigned int rows_l = depth_ref.rows();
+	const unsigned int x = region.tl().x, y = region.tl().y, w = region.width, h = region.height;
 
 	//Smooth
 	const float k_smooth = 100.f;
 	Matrix<float, NUM_LABELS+1, 1> weights;
 
-	for (unsigned int u=0; u<cols_i; u++)
-		for (unsigned int v=0; v<rows_i; v++)
+	for (unsigned int u=x; u<x+w; u++)
+		for (unsigned int v=y; v<y+h; v++)
 		{
-			const Vector3f p(depth_ref(v,u), xx_ref(v,u), yy_ref(v,u));
-			const unsigned int pixel_ind = v+u*rows_i;
+			const unsigned int pixel_ind = v+u*rows_l;
+			weights.fill(0.f);
 
 			if (labels_ref(v,u) < NUM_LABELS)
 			{
+				const Vector3f p(depth_ref(v,u), intr.x(depth_ref(v,u), u), intr.y(depth_ref(v,u), v));
 				const unsigned int lab = labels_ref(v,u);
-				weights.fill(0.f);
 
-				//Compute distance to its original label
-				const float ref_dist = (kmeans.col(lab) - p).squaredNorm();
+				//Distances to all the centers at once (vectorized), and to its original label
+				const Matrix<float, 1, NUM_LABELS> dist = (kmeans.colwise() - p).colwise().squaredNorm();
+				const float ref_dist = dist(lab);
 
 				for (unsigned int l=0; l<NUM_LABELS; l++)
 					if (connectivity[lab][l])
 					{
-						const float dist = (kmeans.col(l) - p).squaredNorm();
-						//const float ref_dist = (kmeans.col(lab) - p).squaredNorm();
-						const float exponent = k_smooth*abs(ref_dist - dist);
-
+						const float exponent = k_smooth*abs(ref_dist - dist(l));
 						if (exponent < 6.f) //Otherwise it is almost zero and doesn't need to be computed
-							weights(l) = exp(-exponent);
+							weights(l) = fastNegExp(exponent);
 					}
 
-				const float sum_weights_inv = 1.f/weights.sumAll();
-				label_funct_ref.col(pixel_ind) = weights*sum_weights_inv;
+				weights *= 1.f/weights.sumAll();
 			}
 			else
-				label_funct_ref(NUM_LABELS, pixel_ind) = 1.f;
+				weights(NUM_LABELS) = 1.f;
+
+			label_funct_ref.col(pixel_ind) = weights;
 		}
 }
 
@@ -387,12 +519,11 @@ void VO_SF::createLabelsPyramidUsingKMeans()
 		image_level = i + round(log2(width/cols));
 
 		//Refs
-		MatrixXi &labels_ref = labels[image_level];
+		MatrixLabels &labels_ref = labels[image_level];
 		const MatrixXf &depth_old_ref = depth_old[image_level];
-		const MatrixXf &xx_old_ref = xx_old[image_level];
-		const MatrixXf &yy_old_ref = yy_old[image_level];
+		const LevelIntrinsics &intr = intrinsics[image_level];
 
-		labels_ref.assign(NUM_LABELS);
+		labels_ref.setConstant(NUM_LABELS);
 	
 		//Compute belonging to each label
 		for (unsigned int u=0; u<cols_i; u++)
@@ -400,7 +531,7 @@ void VO_SF::createLabelsPyramidUsingKMeans()
 				if (depth_old_ref(v,u) != 0.f)
 				{			
 					unsigned int label = 0;
-					const Vector3f p(depth_old_ref(v,u), xx_old_ref(v,u), yy_old_ref(v,u));
+					const Vector3f p(depth_old_ref(v,u), intr.x(depth_old_ref(v,u), u), intr.y(depth_old_ref(v,u), v));
 					float min_dist = (kmeans.col(0) - p).squaredNorm();
 					float dist_here;
 
@@ -423,6 +554,114 @@ void VO_SF::createLabelsPyramidUsingKMeans()
 	}
 }
 
+void VO_SF::createLabelsPyramidByDownsampling()
+{
+	//Every level is computed from the previous one (2x2 pixels), so only its columns are processed in parallel
+	for (unsigned int i = 1; i<ctf_levels; i++)
+	{
+		const unsigned int cols_l = cols >> i;
+		tbb::parallel_for(tbb::blocked_range<unsigned int>(0, cols_l, 8), LabelPyramidColumnsFn(*this, i));
+	}
+}
+
+void VO_SF::downsampleLabels(unsigned int level_ctf, unsigned int first_col, unsigned int last_col)
+{
+	//Threshold to use (or not) the fine pixels, as in createImagePyramid()
+	const float max_depth_dif = 0.1f;
+
+	//Dimensions of the level (the member variables rows_i, cols_i... are not used because columns are processed in parallel)
+	const unsigned int max_level = round(log2(width/cols));
+	const unsigned int rows_l = rows >> level_ctf;
+	const unsigned int rows_prev = rows >> (level_ctf - 1);
+	const unsigned int level_here = level_ctf + max_level;
+
+	//Refs
+	const MatrixXf &depth_prev = depth_old[level_here-1];
+	const Matrix<float, NUM_LABELS+1, Dynamic> &label_funct_prev = label_funct[level_here-1];
+	const MatrixXf &depth_ref = depth_old[level_here];
+	MatrixLabels &labels_ref = labels[level_here];
+	Matrix<float, NUM_LABELS+1, Dynamic> &label_funct_ref = label_funct[level_here];
+
+	Matrix<float, NUM_LABELS+1, 1> acu, acu_all;
+	for (unsigned int u=first_col; u<last_col; u++)
+		for (unsigned int v=0; v<rows_l; v++)
+		{
+			const unsigned int pixel_ind = v+u*rows_l;
+			const float d = depth_ref(v,u);
+
+			//Average the labelling functions of the 2x2 pixels of the previous level with a similar depth (all the valid ones if none is similar)
+			acu.fill(0.f); acu_all.fill(0.f);
+			unsigned int num = 0, num_all = 0;
+			if (d != 0.f)
+				for (unsigned int uf=2*u; uf<2*u+2; uf++)
+					for (unsigned int vf=2*v; vf<2*v+2; vf++)
+					{
+						const float d_prev = depth_prev(vf,uf);
+						if (d_prev == 0.f)
+							continue;
+
+						acu_all += label_funct_prev.col(vf+uf*rows_prev); num_all++;
+						if (abs(d_prev - d) < max_depth_dif)
+						{
+							acu += label_funct_prev.col(vf+uf*rows_prev); num++;
+						}
+					}
+
+			if (num == 0)
+			{
+				acu = acu_all; num = num_all;
+			}
+
+			if (num == 0)
+			{
+				labels_ref(v,u) = NUM_LABELS;
+				label_funct_ref.col(pixel_ind).fill(0.f);
+				label_funct_ref(NUM_LABELS, pixel_ind) = 1.f;
+			}
+			else
+			{
+				label_funct_ref.col(pixel_ind) = acu/float(num);
+
+				unsigned int label;
+				label_funct_ref.col(pixel_ind).head<NUM_LABELS>().maxCoeff(&label);
+				labels_ref(v,u) = label;
+			}
+		}
+}
+
+void VO_SF::trackClusters()
+{
+	const float max_dist_match = 0.2f;	//Max distance (in meters) between a cluster and the last one moved with its motion
 
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		cluster_match[l] = -1;
 
+	//Move the last centers with their motions (as in warpStaticDynamicSegmentation) and sort all the possible pairs by distance
+	vector<pair<float, pair<int,int> > > pairs;
+	if (last_motion_valid && last_clusters_valid)
+		for (unsigned int li=0; li<NUM_LABELS; li++)
+			if (size_kmeans_last[li] != 0)
+			{
+				const Matrix4f trans = se3::inverse(T_clusters_last[li]);
+				const Vector3f kmeans_w = trans.block<3,3>(0,0)*kmeans_last.col(li) + trans.block<3,1>(0,3);
+				for (unsigned int l=0; l<NUM_LABELS; l++)
+				{
+					const float dist2 = (kmeans.col(l) - kmeans_w).squaredNorm();
+					if ((size_kmeans[l] != 0)&&(dist2 < square(max_dist_match)))
+						pairs.push_back(make_pair(dist2, make_pair(l, li)));
+				}
+			}
+	std::sort(pairs.begin(), pairs.end());
 
+	//Greedy one-to-one matching (closest pairs first)
+	bool last_used[NUM_LABELS] = {false};
+	for (size_t p=0; p<pairs.size(); p++)
+	{
+		const int l = pairs[p].second.first, li = pairs[p].second.second;
+		if ((cluster_match[l] < 0)&&(!last_used[li]))
+		{
+			cluster_match[l] = li;
+			last_used[li] = true;
+		}
+	}
+}
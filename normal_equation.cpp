@@ -74,12 +74,32 @@ void NormalEquation<float, 6, 1>::get(Traits::MatrixA &A, Traits::VectorB &b)
 	//b = Traits::VectorB::MapAligned(data_b); //This might crash
 }
 
+void NormalEquation<float, 6, 1>::add(NormalEquation<float, 6, 1> const &o)
+{
+    for(int i = 0; i < Size; ++i)
+        data[i] += o.data[i];
+
+    for(int i = 0; i < SizeB; ++i)
+        data_b[i] += o.data_b[i];
+}
+
 void NormalEquation<float, 6, 1>::update(const Traits::JacobianMatrix &jacobian, const Traits::ResidualVector &residual, const Traits::InformationMatrix &information)
+{
+  // the kernel loads 8 floats
+  MEMORY_ALIGN16(float padded[8]);
+  for(int i = 0; i < 6; ++i)
+    padded[i] = jacobian(i);
+  padded[6] = padded[7] = 0.0f;
+
+  update(padded, residual, information);
+}
+
+void NormalEquation<float, 6, 1>::update(float const *jacobian, float residual, float information)
 {
   __m128 s = _mm_set1_ps(information);
   __m128 r = _mm_mul_ps(s, _mm_set1_ps(residual));
-  __m128 v1234 = _mm_load_ps(jacobian.data());
-  __m128 v56xx = _mm_load_ps(jacobian.data() + 4);
+  __m128 v1234 = _mm_load_ps(jacobian);
+  __m128 v56xx = _mm_load_ps(jacobian + 4);
 
   _mm_store_ps(data_b + 0, _mm_sub_ps(_mm_load_ps(data_b + 0), _mm_mul_ps(v1234, r)));
   _mm_store_ps(data_b + 4, _mm_sub_ps(_mm_load_ps(data_b + 4), _mm_mul_ps(v56xx, r)));
@@ -0,0 +1,129 @@
+/*********************************************************************************
+**Fast Odometry and Scene Flow from RGB-D Cameras based on Geometric Clustering	**
+**------------------------------------------------------------------------------**
+**																				**
+**	Copyright(c) 2017, Mariano Jaimez Tarifa, University of Malaga & TU Munich	**
+**	Copyright(c) 2017, Christian Kerl, TU Munich								**
+**	Copyright(c) 2017, MAPIR group, University of Malaga						**
+**	Copyright(c) 2017, Computer Vision group, TU Munich							**
+**																				**
+**  This program is free software: you can redistribute it and/or modify		**
+**  it under the terms of the GNU General Public License (version 3) as			**
+**	published by the Free Software Foundation.									**
+**																				**
+**  This program is distributed in the hope that it will be useful, but			**
+**	WITHOUT ANY WARRANTY; without even the implied warranty of					**
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the				**
+**  GNU General Public License for more details.								**
+**																				**
+**  You should have received a copy of the GNU General Public License			**
+**  along with this program. If not, see <http://www.gnu.org/licenses/>.		**
+**																				**
+*********************************************************************************/
+
+#ifndef se3_H
+#define se3_H
+
+#include <Eigen/Core>
+#include <cmath>
+
+
+//Closed-form operations on rigid transformations (homogeneous 4x4 matrices with the last row equal to [0 0 0 1]).
+//Twists are ordered as in the solver: translational velocity first (0-2), angular velocity after (3-5).
+namespace se3
+{
+	typedef Eigen::Matrix<float, 6, 1> Twist;
+
+	inline Eigen::Matrix3f hat(const Eigen::Vector3f &w)
+	{
+		Eigen::Matrix3f W;
+		W <<	0.f, -w(2),  w(1),
+				w(2),  0.f, -w(0),
+			   -w(1),  w(0),  0.f;
+		return W;
+	}
+
+	//Rodrigues formula for the rotation and its left Jacobian V for the translation: T = [R V*v; 0 1]
+	inline Eigen::Matrix4f exp(const Twist &twist)
+	{
+		const Eigen::Vector3f v = twist.head<3>(), w = twist.tail<3>();
+		const Eigen::Matrix3f W = hat(w), W2 = W*W;
+		const float theta2 = w.squaredNorm(), theta = std::sqrt(theta2);
+
+		//Series expansions for small angles (the closed forms lose all the precision in float)
+		float a, b, c;
+		if (theta < 0.1f)
+		{
+			a = 1.f - theta2*(1.f/6.f - theta2/120.f);
+			b = 0.5f - theta2*(1.f/24.f - theta2/720.f);
+			c = 1.f/6.f - theta2*(1.f/120.f - theta2/5040.f);
+		}
+		else
+		{
+			const float half_sin = std::sin(0.5f*theta);
+			a = std::sin(theta)/theta;
+			b = 2.f*half_sin*half_sin/theta2;
+			c = (theta - std::sin(theta))/(theta2*theta);
+		}
+
+		Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+		T.block<3,3>(0,0) += a*W + b*W2;
+		T.block<3,1>(0,3) = v + b*(W*v) + c*(W2*v);
+		return T;
+	}
+
+	//Inverse of exp (the rotation angle is assumed to be smaller than pi)
+	inline Twist log(const Eigen::Matrix4f &T)
+	{
+		const Eigen::Matrix3f R = T.block<3,3>(0,0);
+		const Eigen::Vector3f dR(R(2,1) - R(1,2), R(0,2) - R(2,0), R(1,0) - R(0,1));
+		const float cos_theta = std::max(-1.f, std::min(1.f, 0.5f*(R.trace() - 1.f)));
+		const float sin_theta = 0.5f*dR.norm();
+		const float theta = std::atan2(sin_theta, cos_theta);
+
+		Eigen::Vector3f w;
+		if (theta < 0.1f)
+			w = (0.5f + theta*theta/12.f)*dR;
+		else if (sin_theta > 1e-3f)
+			w = (0.5f*theta/sin_theta)*dR;
+		else
+		{
+			//Close to pi: the axis is taken from the symmetric part of R, (R + R^T)/2 = cos*I + (1 - cos)*n*n^T
+			const Eigen::Matrix3f S = 0.5f*(R + R.transpose()) - cos_theta*Eigen::Matrix3f::Identity();
+			unsigned int k; S.diagonal().maxCoeff(&k);
+			Eigen::Vector3f n = S.col(k)/std::sqrt(S(k,k)*(1.f - cos_theta));
+			if (n.dot(dR) < 0.f) n = -n;
+			w = theta*n;
+		}
+
+		//Inverse of V
+		const float theta2 = theta*theta;
+		const float d = (theta < 0.1f) ? 1.f/12.f + theta2/720.f
+									   : (1.f - 0.5f*theta*std::sin(theta)/(1.f - std::cos(theta)))/theta2;
+		const Eigen::Matrix3f W = hat(w);
+		const Eigen::Vector3f t = T.block<3,1>(0,3);
+
+		Twist twist;
+		twist.head<3>() = t - 0.5f*(W*t) + d*(W*(W*t));
+		twist.tail<3>() = w;
+		return twist;
+	}
+
+	inline Eigen::Matrix4f compose(const Eigen::Matrix4f &A, const Eigen::Matrix4f &B)
+	{
+		Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+		T.block<3,3>(0,0) = A.block<3,3>(0,0)*B.block<3,3>(0,0);
+		T.block<3,1>(0,3) = A.block<3,3>(0,0)*B.block<3,1>(0,3) + A.block<3,1>(0,3);
+		return T;
+	}
+
+	inline Eigen::Matrix4f inverse(const Eigen::Matrix4f &T)
+	{
+		Eigen::Matrix4f T_inv = Eigen::Matrix4f::Identity();
+		T_inv.block<3,3>(0,0) = T.block<3,3>(0,0).transpose();
+		T_inv.block<3,1>(0,3) = -(T_inv.block<3,3>(0,0)*T.block<3,1>(0,3));
+		return T_inv;
+	}
+}
+
+#endif
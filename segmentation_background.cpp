@@ -22,6 +22,7 @@
 *********************************************************************************/
 
 #include <joint_vo_sf.h>
+#include <structs_parallelization.h>
 
 using namespace mrpt;
 using namespace mrpt::utils;
@@ -38,68 +39,24 @@ void VO_SF::segmentStaticDynamic()
 	//First warp images according to the estimated odometry
 	warpImagesAccurate();
 
-	//Aux variables and parameters
-	Matrix<float, NUM_LABELS, 1> lab_res_c, lab_res_d, weighted_res;
-	lab_res_c.fill(0.f); lab_res_d.fill(0.f); 
-	const float trunc_threshold = 0.2f;
-	const float res_depth_t = 0.1f;
-
-	//Refs
-	const MatrixXf &depth_old_ref = depth_old[image_level];
-	const MatrixXf &depth_warped_ref = depth_warped[image_level];
-	const MatrixXf &intensity_old_ref = intensity_old[image_level];
-	const MatrixXf &intensity_warped_ref = intensity_warped[image_level];
-	const MatrixXi &labels_ref = labels[image_level];
-
-
-	//First, compute a mask of edges (to downweight their residuals, they are always high no matter what segment they belong)
-	Matrix<bool, Dynamic, Dynamic> edge_mask(rows,cols); edge_mask.fill(0.f);
-	const float threshold_edge = 0.3f;
-
-	for (unsigned int u=1; u<cols-1; u++)
-		for (unsigned int v=1; v<rows-1; v++)
-		{
-			const float d_here = depth_old_ref(v,u);
-			if (d_here != 0.f)
-			{	
-				const float sum_dif_depth = abs(depth_old_ref(v+1,u) - d_here) + abs(depth_old_ref(v-1,u) - d_here) 
-										  + abs(depth_old_ref(v,u+1) - d_here) + abs(depth_old_ref(v,u-1) - d_here);
-				edge_mask(v,u) = (sum_dif_depth < threshold_edge);
-			}
-		}
-
-	//Compute residuals
-	for (unsigned int u=0; u<cols; u++)
-		for (unsigned int v=0; v<rows; v++)
-			if ((depth_old_ref(v,u) != 0.f)&&(depth_warped_ref(v,u) != 0.f))
-			{
-				const unsigned int pixel_label = labels_ref(v,u); //Using the binary segmentation here
-				
-				//Truncated Mean with occlusion handling
-				const float dif_depth = depth_old_ref(v,u) - depth_warped_ref(v,u);
-				if (dif_depth < res_depth_t)
-				{
-					lab_res_d[pixel_label] += edge_mask(v,u)*min(trunc_threshold, abs(dif_depth));
-					lab_res_c[pixel_label] += edge_mask(v,u)*min(0.5f, abs(intensity_old_ref(v,u) - intensity_warped_ref(v,u)));
-				}
-				else if (dif_depth < 2.f*res_depth_t)
-				{
-					const float mult_factor = edge_mask(v,u)*(2.f*res_depth_t - dif_depth);
-					lab_res_d[pixel_label] += mult_factor;
-					lab_res_c[pixel_label] += mult_factor*min(0.5f, abs(intensity_old_ref(v,u) - intensity_warped_ref(v,u)));
-				}		
-			}
+	//Edge mask and per-label residuals (fused in a single parallel sweep)
+	SegmentationResidualsFn fn(*this);
+	const SegmentationResiduals res = tbb::parallel_reduce(ImageDomain(0, rows, 30, 0, cols, 40), SegmentationResiduals(), fn, SegmentationResiduals::Reduce());
 
+	Matrix<float, NUM_LABELS, 1> weighted_res;
 	for (unsigned int l=0; l<NUM_LABELS; l++)
 	{	
+		float lab_res_c = res.c[l], lab_res_d = res.d[l];
 		if (size_kmeans[l] != 0)
 		{
-			lab_res_c[l] /= size_kmeans[l];
-			lab_res_d[l] /= size_kmeans[l];
+			lab_res_c /= size_kmeans[l];
+			lab_res_d /= size_kmeans[l];
 		}
 
-		//Compute the overall residual
-		weighted_res[l] = k_photometric_res*lab_res_c[l] + lab_res_d[l]/max(1e-6f,kmeans(0,l)); 
+		//Compute the overall residual (the intensity is not trusted in the geometric-only mode)
+		if (residual_mode == RESIDUALS_GEOMETRIC)
+			lab_res_c = 0.f;
+		weighted_res[l] = k_photometric_res*lab_res_c + lab_res_d/max(1e-6f,kmeans(0,l)); 
 	}
 
 
@@ -188,6 +145,11 @@ void VO_SF::optimizeSegmentation(Matrix<float, NUM_LABELS, 1> &r)
 	b_segm = AtA.ldlt().solve(AtB);	
 
 	//Classify clusters as static, uncertain or moving
+	classifyClusters();
+}
+
+void VO_SF::classifyClusters()
+{
 	for (unsigned int l=0; l<NUM_LABELS; l++)
 	{
 		if (b_segm[l] > 0.667f) 
@@ -209,19 +171,42 @@ void VO_SF::optimizeSegmentation(Matrix<float, NUM_LABELS, 1> &r)
 }
 
 
+bool VO_SF::segmentStaticDynamicFromTemporal()
+{
+	//There is no segmentation to propagate in the first frame
+	if (!use_b_temp_reg)
+		return false;
+
+	//The warped segmentation is only trusted if (almost) every pixel falls into a cluster which is clearly static or moving
+	unsigned int num_pixels = 0, num_uncertain = 0;
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+	{
+		num_pixels += size_kmeans[l];
+		if ((b_segm_warped[l] >= 0.333f)&&(b_segm_warped[l] <= 0.667f))
+			num_uncertain += size_kmeans[l];
+	}
+
+	if ((num_pixels == 0)||(num_uncertain > single_pass_max_uncertain*num_pixels))
+		return false;
+
+	b_segm = b_segm_warped;
+	classifyClusters();
+	single_pass_frames++;
+	return true;
+}
+
 void VO_SF::warpStaticDynamicSegmentation()
 {
 	//Warp the KMeans and then compute belongings to them. 
 	//-----------------------------------------------------------
 	const MatrixXf &depth_ref = depth[image_level];
-	const MatrixXf &xx_ref = xx[image_level];
-	const MatrixXf &yy_ref = yy[image_level];
+	const LevelIntrinsics &intr = intrinsics[image_level];
 
 	//Warped Kmeans
 	Matrix<float, 3, NUM_LABELS> kmeans_w;
 	for (unsigned int l=0; l<NUM_LABELS; l++)
 	{
-        const Matrix4f trans = T_clusters[l].inverse();
+        const Matrix4f trans = se3::inverse(T_clusters[l]);
 		const Vector4f kmeans_homog(kmeans(0,l), kmeans(1,l), kmeans(2,l), 1.f);
 		kmeans_w.col(l) = trans.block<3,4>(0,0)*kmeans_homog;
 	}
@@ -237,7 +222,7 @@ void VO_SF::warpStaticDynamicSegmentation()
 		for (unsigned int v=0; v<rows; v++)
 			if (depth_ref(v,u) != 0.f)
 			{
-				const Vector3f p(depth_ref(v,u), xx_ref(v,u), yy_ref(v,u));
+				const Vector3f p(depth_ref(v,u), intr.x(depth_ref(v,u), u), intr.y(depth_ref(v,u), v));
 				unsigned int label = 0;
 				float min_dist = (kmeans_w.col(0) - p).squaredNorm();
 				float dist_here;
@@ -262,22 +247,47 @@ void VO_SF::warpStaticDynamicSegmentation()
 		use_b_temp_reg = true;
 }
 
-void VO_SF::computeSegTemporalRegValues()
+void VO_SF::warpStaticDynamicSegmentationWithOdometry()
 {
-	b_segm_warped.fill(0.f);
+	//Done at the highest resolution
+	cols_i = cols; rows_i = rows;
 	image_level = round(log2(width/cols));
-	const MatrixXi &labels_ref = labels[image_level];
-	const MatrixXf &depth_old_ref = depth_old[image_level];
 
+	//Camera parameters
+	const LevelIntrinsics &intr = intrinsics[image_level];
+
+	//Refs
+	const MatrixXf &depth_ref = depth[image_level];
+	const MatrixXf b_segm_image_old = b_segm_image_warped;
+
+	//Look for the pixel of the old image that every new point comes from (nearest neighbour)
 	for (unsigned int u=0; u<cols; u++)
 		for (unsigned int v=0; v<rows; v++)
-			if (depth_old_ref(v,u) != 0.f)
-				b_segm_warped[labels_ref(v,u)] += b_segm_image_warped(v,u);
-	
-	
+		{
+			b_segm_image_warped(v,u) = 0.f;
+			const float z = depth_ref(v,u);
+			if (z != 0.f)
+			{
+				const float x = intr.x(z, u), y = intr.y(z, v);
+				const float depth_w = T_odometry(0)*z + T_odometry(4)*x + T_odometry(8)*y + T_odometry(12);
+				const float x_w = T_odometry(1)*z + T_odometry(5)*x + T_odometry(9)*y + T_odometry(13);
+				const float y_w = T_odometry(2)*z + T_odometry(6)*x + T_odometry(10)*y + T_odometry(14);
+				if (depth_w <= 0.f)
+					continue;
+
+				const int uwarp = int(round(intr.f*x_w/depth_w + intr.disp_u));
+				const int vwarp = int(round(intr.f*y_w/depth_w + intr.disp_v));
+				if ((uwarp >= 0)&&(uwarp < int(cols))&&(vwarp >= 0)&&(vwarp < int(rows)))
+					b_segm_image_warped(v,u) = b_segm_image_old(vwarp,uwarp);
+			}
+		}
+}
+
+void VO_SF::computeSegTemporalRegValues()
+{
+	//The per-cluster sums of b_segm_image_warped are accumulated while the labels are computed (kMeans3DCoord)
 	for (unsigned int l=0; l<NUM_LABELS; l++)
-		if (size_kmeans[l] != 0)
-			b_segm_warped[l] /= size_kmeans[l];
+		b_segm_warped[l] = (size_kmeans[l] != 0) ? b_segm_sum[l]/size_kmeans[l] : 0.f;
 }
 
 
@@ -29,6 +29,24 @@ using namespace mrpt::utils;
 using namespace std;
 using namespace Eigen;
 
+//Subsampled view of (one channel of) a cv::Mat as an Eigen matrix, without copying.
+//The images are stored upside down (v pointing up), so they are ingested with colwise().reverse()
+template<typename T>
+inline Map<const Matrix<T, Dynamic, Dynamic, RowMajor>, 0, Stride<Dynamic, Dynamic> > cvMatView(const cv::Mat &image, unsigned int rows, unsigned int cols,
+																						unsigned int res_factor, unsigned int row_offset = 0, unsigned int channel = 0)
+{
+	typedef Map<const Matrix<T, Dynamic, Dynamic, RowMajor>, 0, Stride<Dynamic, Dynamic> > View;
+	return View(image.ptr<T>(row_offset) + channel, rows, cols, Stride<Dynamic, Dynamic>(res_factor*image.step1(), res_factor*image.channels()));
+}
+
+//Writable view of one channel of a cv::Mat as an Eigen matrix (used to export images without per-pixel accesses)
+template<typename T>
+inline Map<Matrix<T, Dynamic, Dynamic, RowMajor>, 0, Stride<Dynamic, Dynamic> > cvMatChannel(cv::Mat &image, unsigned int channel = 0)
+{
+	typedef Map<Matrix<T, Dynamic, Dynamic, RowMajor>, 0, Stride<Dynamic, Dynamic> > View;
+	return View(image.ptr<T>() + channel, image.rows, image.cols, Stride<Dynamic, Dynamic>(image.step1(), image.channels()));
+}
+
 //A strange size for "ws..." due to the fact that some pixels are used twice for odometry and scene flow (hence the 3/2 safety factor)
 VO_SF::VO_SF(unsigned int res_factor) : ws_foreground(3*640*480/(2*res_factor*res_factor)), ws_background(3*640*480/(2*res_factor*res_factor))  
 {
@@ -48,11 +66,50 @@ VO_SF::VO_SF(unsigned int res_factor) : ws_foreground(3*640*480/(2*res_factor*re
 	max_iter_irls = 10;
 	max_iter_per_level = 3;
 	use_b_temp_reg = false;
+	identity_warp = false;
+	identity_level_valid = false;
+	use_single_pass = false;
+	single_pass_max_uncertain = 0.1f;
+	single_pass_frames = two_pass_frames = 0;
+	odometry_only = false;
+	odometry_only_reuse_segm = true;
+	use_pixel_selection = false;
+	max_pixels_per_cluster = 1000;
+	recompute_jacobians_irls = false;
+	residual_mode = RESIDUALS_BOTH;
+	label_pyramid_by_downsampling = false;
+	use_local_clustering = false;
+	use_single_sweep_clusters = false;
+	use_motion_gating = false;
+	gating_depth_threshold = 0.005f;
+	gating_intensity_threshold = 0.003f;
+	gating_segmentation_ratio = 0.5f;
+	gated_frames = gated_clusters_reused = gated_segmentation_reused = 0;
+	use_incremental_clustering = false;
+	max_frames_incremental = 10;
+	clustering_tile_size = 16;
+	clustering_state_valid = false;
+	frames_incremental = 0;
+
+	//Lookup table used to smooth the regions
+	for (unsigned int i=0; i<=EXP_TABLE_SIZE; i++)
+		exp_table[i] = exp(-6.f*float(i)/float(EXP_TABLE_SIZE));
 
 	//CamPose
 	cam_pose.setFromValues(0,0,0,0,0,0);
 	cam_oldpose = cam_pose;
 
+	//Motion prior
+	motion_prior = PRIOR_NONE;
+	T_odometry.setIdentity();
+	T_odometry_prior.setIdentity();
+	prior_pending = false;
+	last_motion_valid = false;
+	use_cluster_tracking = false;
+	last_clusters_valid = false;
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		cluster_match[l] = -1;
+
 	//Resize matrices which are not in a "pyramid"
 	depth_wf.setSize(height,width);
 	intensity_wf.setSize(height,width);
@@ -65,7 +122,10 @@ VO_SF::VO_SF(unsigned int res_factor) : ws_foreground(3*640*480/(2*res_factor*re
 	dct.resize(rows,cols); ddt.resize(rows,cols);
     dcu.resize(rows,cols); ddu.resize(rows,cols);
     dcv.resize(rows,cols); ddv.resize(rows,cols);
+    rx.resize(rows,cols); ry.resize(rows,cols);
+    rx_intensity.resize(rows,cols); ry_intensity.resize(rows,cols);
     Null.resize(rows,cols);
+    pixel_selected.resize(rows,cols);
     weights_c.setSize(rows,cols);
     weights_d.setSize(rows,cols);
 
@@ -74,12 +134,9 @@ VO_SF::VO_SF(unsigned int res_factor) : ws_foreground(3*640*480/(2*res_factor*re
     const unsigned int pyr_levels = round(log2(width/cols)) + ctf_levels;
     intensity.resize(pyr_levels); intensity_old.resize(pyr_levels); intensity_inter.resize(pyr_levels);
     depth.resize(pyr_levels); depth_old.resize(pyr_levels); depth_inter.resize(pyr_levels);
-    xx.resize(pyr_levels); xx_inter.resize(pyr_levels); xx_old.resize(pyr_levels);
-    yy.resize(pyr_levels); yy_inter.resize(pyr_levels); yy_old.resize(pyr_levels);
     intensity_warped.resize(pyr_levels);
     depth_warped.resize(pyr_levels);
-    xx_warped.resize(pyr_levels);
-    yy_warped.resize(pyr_levels);
+    intrinsics.resize(pyr_levels);
 	labels.resize(pyr_levels);
 	label_funct.resize(pyr_levels);
 
@@ -90,17 +147,11 @@ VO_SF::VO_SF(unsigned int res_factor) : ws_foreground(3*640*480/(2*res_factor*re
         intensity[i].resize(rows_i, cols_i); intensity_old[i].resize(rows_i, cols_i); intensity_inter[i].resize(rows_i, cols_i);
         depth[i].resize(rows_i, cols_i); depth_inter[i].resize(rows_i, cols_i); depth_old[i].resize(rows_i, cols_i);
         depth[i].assign(0.f); depth_old[i].assign(0.f);
-        xx[i].resize(rows_i, cols_i); xx_inter[i].resize(rows_i, cols_i); xx_old[i].resize(rows_i, cols_i);
-        xx[i].assign(0.f); xx_old[i].assign(0.f);
-        yy[i].resize(rows_i, cols_i); yy_inter[i].resize(rows_i, cols_i); yy_old[i].resize(rows_i, cols_i);
-        yy[i].assign(0.f); yy_old[i].assign(0.f);
 
 		if (cols_i <= cols)
 		{
             intensity_warped[i].resize(rows_i,cols_i);
             depth_warped[i].resize(rows_i,cols_i);
-            xx_warped[i].resize(rows_i,cols_i);
-            yy_warped[i].resize(rows_i,cols_i);
 			labels[i].resize(rows_i, cols_i);
 			label_funct[i].resize(NUM_LABELS+1, rows_i*cols_i);
             label_funct[i].assign(0.f);
@@ -139,9 +190,7 @@ void VO_SF::loadImagePairFromFiles(string files_dir, unsigned int res_factor)
     string name = files_dir + aux;
 
     cv::Mat intensity = cv::imread(name.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            intensity_wf(height-1-v,u) = norm_factor*intensity.at<unsigned char>(res_factor*v+1,res_factor*u);
+    intensity_wf = norm_factor*cvMatView<unsigned char>(intensity, height, width, res_factor, 1).cast<float>().colwise().reverse();
 
     sprintf(aux, "depth0.png");
     name = files_dir + aux;
@@ -150,9 +199,7 @@ void VO_SF::loadImagePairFromFiles(string files_dir, unsigned int res_factor)
     cv::Mat depth_float;
     depth.convertTo(depth_float, CV_32FC1, 1.0 / 5000.0);
 
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            depth_wf(height-1-v,u) = depth_float.at<float>(res_factor*v+1,res_factor*u);
+    depth_wf = cvMatView<float>(depth_float, height, width, res_factor, 1).colwise().reverse();
 
 	createImagePyramid();
 
@@ -164,18 +211,14 @@ void VO_SF::loadImagePairFromFiles(string files_dir, unsigned int res_factor)
     name = files_dir + aux;
 
     intensity = cv::imread(name.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            intensity_wf(height-1-v,u) = norm_factor*intensity.at<unsigned char>(res_factor*v+1,res_factor*u);
+    intensity_wf = norm_factor*cvMatView<unsigned char>(intensity, height, width, res_factor, 1).cast<float>().colwise().reverse();
 
     sprintf(aux, "depth1.png");
     name = files_dir + aux;
 
     depth = cv::imread(name, -1);
     depth.convertTo(depth_float, CV_32FC1, 1.0 / 5000.0);
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            depth_wf(height-1-v,u) = depth_float.at<float>(res_factor*v+1,res_factor*u);
+    depth_wf = cvMatView<float>(depth_float, height, width, res_factor, 1).colwise().reverse();
 
 	createImagePyramid();
 }
@@ -192,17 +235,13 @@ void VO_SF::setImagePair(const std::vector<cv::Mat> rgb, const std::vector<cv::M
 
     cv::Mat intensity ( rgb[0].rows, rgb[0].cols, CV_8UC1 );// = cv::imread(name.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
     cv::cvtColor ( rgb[0], intensity, CV_BGR2GRAY );
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            intensity_wf(height-1-v,u) = norm_factor*intensity.at<unsigned char>(res_factor*v+1,res_factor*u);
+    intensity_wf = norm_factor*cvMatView<unsigned char>(intensity, height, width, res_factor, 1).cast<float>().colwise().reverse();
 
     //cv::Mat depth = cv::imread(name, -1);
     cv::Mat depth_float;
     depth[0].convertTo(depth_float, CV_32FC1, 1.0 / 5000.0);
 
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            depth_wf(height-1-v,u) = depth_float.at<float>(res_factor*v+1,res_factor*u);
+    depth_wf = cvMatView<float>(depth_float, height, width, res_factor, 1).colwise().reverse();
 
     createImagePyramid();
 
@@ -213,15 +252,11 @@ void VO_SF::setImagePair(const std::vector<cv::Mat> rgb, const std::vector<cv::M
 
     //intensity = cv::imread(name.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
     cv::cvtColor ( rgb[1], intensity, CV_BGR2GRAY );
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            intensity_wf(height-1-v,u) = norm_factor*intensity.at<unsigned char>(res_factor*v+1,res_factor*u);
+    intensity_wf = norm_factor*cvMatView<unsigned char>(intensity, height, width, res_factor, 1).cast<float>().colwise().reverse();
 
     //depth = cv::imread(name, -1);
     depth[1].convertTo(depth_float, CV_32FC1, 1.0 / 5000.0);
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            depth_wf(height-1-v,u) = depth_float.at<float>(res_factor*v+1,res_factor*u);
+    depth_wf = cvMatView<float>(depth_float, height, width, res_factor, 1).colwise().reverse();
 
     createImagePyramid();
 }
@@ -245,15 +280,10 @@ bool VO_SF::loadImageFromSequence(string files_dir, unsigned int index, unsigned
 	}
 		
 
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-		{
-			cv::Vec3b color_here = color.at<cv::Vec3b>(res_factor*v,res_factor*u);
-			im_r(height-1-v,u) = norm_factor*color_here[2];
-			im_g(height-1-v,u) = norm_factor*color_here[1];
-			im_b(height-1-v,u) = norm_factor*color_here[0];
-			intensity_wf(height-1-v,u) = 0.299f*im_r(height-1-v,u) + 0.587f*im_g(height-1-v,u) + 0.114f*im_b(height-1-v,u);
-		}
+    im_r = norm_factor*cvMatView<unsigned char>(color, height, width, res_factor, 0, 2).cast<float>().colwise().reverse();
+    im_g = norm_factor*cvMatView<unsigned char>(color, height, width, res_factor, 0, 1).cast<float>().colwise().reverse();
+    im_b = norm_factor*cvMatView<unsigned char>(color, height, width, res_factor, 0, 0).cast<float>().colwise().reverse();
+    intensity_wf = 0.299f*im_r + 0.587f*im_g + 0.114f*im_b;
 
     sprintf(aux, "d%d.png", index);
     name = files_dir + aux;
@@ -262,9 +292,7 @@ bool VO_SF::loadImageFromSequence(string files_dir, unsigned int index, unsigned
     cv::Mat depth_float;
     depth.convertTo(depth_float, CV_32FC1, 1.0 / 5000.0);
 
-    for (unsigned int v=0; v<height; v++)
-        for (unsigned int u=0; u<width; u++)
-            depth_wf(height-1-v,u) = depth_float.at<float>(res_factor*v,res_factor*u);
+    depth_wf = cvMatView<float>(depth_float, height, width, res_factor).colwise().reverse();
 
 	return false;
 }
@@ -285,16 +313,16 @@ void VO_SF::saveFlowAndSegmToFile(string files_dir)
 	//z = depth -> pointing to the front
 	cv::Mat rmx(rows, cols, CV_32FC1), rmy(rows, cols, CV_32FC1), rmz(rows, cols, CV_32FC1);
 	cv::Mat segm_col(rows, cols, CV_8UC3), kmeans(rows, cols, CV_8UC3);
-    for (unsigned int v=0; v<rows; v++)
-        for (unsigned int u=0; u<cols; u++)
-        {
-            rmx.at<float>(v,u) = motionfield[1](rows-1-v,u);
-            rmy.at<float>(v,u) = motionfield[2](rows-1-v,u);
-            rmz.at<float>(v,u) = motionfield[0](rows-1-v,u);
-            //std::cout << motionfield[1](rows-1-v,u) << " " << motionfield[2](rows-1-v,u) << " " << motionfield[1](rows-1-v,u) << std::endl;
-			segm_col.at<cv::Vec3b>(v,u) = cv::Vec3b(255.f*backg_image[2](rows-1-v,u), 255.f*backg_image[1](rows-1-v,u), 255.f*backg_image[0](rows-1-v,u));
-			kmeans.at<cv::Vec3b>(v,u) = cv::Vec3b(255.f* labels_image[2](rows-1-v,u), 255.f*labels_image[1](rows-1-v,u), 255.f*labels_image[0](rows-1-v,u));
-        }
+	cvMatChannel<float>(rmx) = motionfield[1].colwise().reverse();
+	cvMatChannel<float>(rmy) = motionfield[2].colwise().reverse();
+	cvMatChannel<float>(rmz) = motionfield[0].colwise().reverse();
+
+	//The color images are written channel by channel (BGR)
+	for (unsigned int c=0; c<3; c++)
+	{
+		cvMatChannel<unsigned char>(segm_col, c) = (255.f*backg_image[2-c]).colwise().reverse().cast<unsigned char>();
+		cvMatChannel<unsigned char>(kmeans, c) = (255.f*labels_image[2-c]).colwise().reverse().cast<unsigned char>();
+	}
 
     SFlow << "SFx" << rmx;
     SFlow << "SFy" << rmy;
@@ -323,8 +351,7 @@ void VO_SF::createImagePyramid()
     //Push the frames back
     intensity_old.swap(intensity);
     depth_old.swap(depth);
-    xx_old.swap(xx);
-    yy_old.swap(yy);
+	identity_level_valid = false;
 
     //The number of levels of the pyramid does not match the number of levels used
     //in the odometry computation (because we sometimes want to finish with lower resolutions)
@@ -339,8 +366,6 @@ void VO_SF::createImagePyramid()
         const unsigned int i_1 = i-1;
 		MatrixXf &depth_here = depth[i];
 		MatrixXf &intensity_here = intensity[i];
-		MatrixXf &xx_here = xx[i];
-		MatrixXf &yy_here = yy[i];
 
         if (i == 0)
         {
@@ -421,26 +446,25 @@ void VO_SF::createImagePyramid()
                 }
         }
 
-        //Calculate coordinates "xy" of the points
-        const float inv_f_i = 2.f*tan(0.5f*fovh)/float(cols_i);
-        const float disp_u_i = 0.5f*(cols_i-1);
-        const float disp_v_i = 0.5f*(rows_i-1);
-
-        for (unsigned int u = 0; u < cols_i; u++)
-            for (unsigned int v = 0; v < rows_i; v++)
-                if (depth_here(v,u) != 0.f)
-                {
-                    xx_here(v,u) = (u - disp_u_i)*depth_here(v,u)*inv_f_i;
-                    yy_here(v,u) = (v - disp_v_i)*depth_here(v,u)*inv_f_i;
-                }
-                else
-                {
-                    xx_here(v,u) = 0.f;
-                    yy_here(v,u) = 0.f;
-                }
+        //Camera parameters of the level (the coordinates "xy" of the points are computed from them when needed)
+        intrinsics[i].set(cols_i, rows_i, fovh);
     }
 }
 
+void VO_SF::computeCoordinates(const MatrixXf &depth_in, unsigned int pyr_level, MatrixXf &x, MatrixXf &y) const
+{
+	const LevelIntrinsics &intr = intrinsics[pyr_level];
+	x.resize(depth_in.rows(), depth_in.cols());
+	y.resize(depth_in.rows(), depth_in.cols());
+
+	for (unsigned int u = 0; u < depth_in.cols(); u++)
+		for (unsigned int v = 0; v < depth_in.rows(); v++)
+		{
+			x(v,u) = intr.x(depth_in(v,u), u);
+			y(v,u) = intr.y(depth_in(v,u), v);
+		}
+}
+
 void VO_SF::calculateCoord()
 {
     calculateCoord(cv::Rect(0, 0, cols_i, rows_i));
@@ -454,12 +478,12 @@ void VO_SF::calculateCoord(cv::Rect region)
 
 	//Refs
 	const MatrixXf &depth_old_ref = depth_old[image_level];
-	const MatrixXf &depth_warped_ref = depth_warped[image_level];
+	const MatrixXf &depth_warped_ref = identity_warp ? depth[image_level] : depth_warped[image_level];
+	const MatrixXf &intensity_old_ref = intensity_old[image_level];
+	const MatrixXf &intensity_warped_ref = identity_warp ? intensity[image_level] : intensity_warped[image_level];
 
 	MatrixXf &depth_inter_ref = depth_inter[image_level];
 	MatrixXf &intensity_inter_ref = intensity_inter[image_level];
-	MatrixXf &xx_inter_ref = xx_inter[image_level];
-	MatrixXf &yy_inter_ref = yy_inter[image_level];
 
     for (unsigned int u = x; u < x+w; u++)
         for (unsigned int v = y; v < y+h; v++)
@@ -467,124 +491,286 @@ void VO_SF::calculateCoord(cv::Rect region)
 			if ((depth_old_ref(v,u) != 0.f)&&(depth_warped_ref(v,u) != 0.f))
             {
 				depth_inter_ref(v,u) = 0.5f*(depth_old_ref(v,u) + depth_warped_ref(v,u));
-                xx_inter_ref(v,u) = 0.5f*(xx_old[image_level](v,u) + xx_warped[image_level](v,u));
-                yy_inter_ref(v,u) = 0.5f*(yy_old[image_level](v,u) + yy_warped[image_level](v,u));
             }
 			else
 			{
                 Null(v,u) = true;
                 depth_inter_ref(v,u) = 0.f;
-                xx_inter_ref(v,u) = 0.f;
-                yy_inter_ref(v,u) = 0.f;
 			}
 
-            intensity_inter_ref(v,u) = 0.5f*(intensity_old[image_level](v,u) + intensity_warped[image_level](v,u));
+            intensity_inter_ref(v,u) = 0.5f*(intensity_old_ref(v,u) + intensity_warped_ref(v,u));
 		}
 }
 
 void VO_SF::calculateDerivatives()
 {
-	//Compute weights for the gradients
-	MatrixXf rx(rows_i,cols_i), ry(rows_i,cols_i);
-    rx.fill(1.f); ry.fill(1.f);
-
-	MatrixXf rx_intensity(rows_i,cols_i), ry_intensity(rows_i, cols_i);
-    rx_intensity.fill(1.f); ry_intensity.fill(1.f);
-
-	const MatrixXf &depth_ref = depth_inter[image_level];
-	const MatrixXf &intensity_ref = intensity_inter[image_level];
-	const MatrixXf &xx_ref = xx_inter[image_level];
-	const MatrixXf &yy_ref = yy_inter[image_level];
-
-    const float epsilon_intensity = 1e-6f;
-	const float epsilon_depth = 0.005f;
-
-    for (unsigned int u = 0; u < cols_i-1; u++)
-        for (unsigned int v = 0; v < rows_i; v++)
-            if (Null(v,u) == false)
-            {
-				rx(v,u) = abs(depth_ref(v,u+1) - depth_ref(v,u)) + epsilon_depth;
-				rx_intensity(v,u) = abs(intensity_ref(v,u+1) - intensity_ref(v,u)) + epsilon_intensity;
-            }
-
-    for (unsigned int u = 0; u < cols_i; u++)
-        for (unsigned int v = 0; v < rows_i-1; v++)
-            if (Null(v,u) == false)
-            {
-				ry(v,u) = abs(depth_ref(v+1,u) - depth_ref(v,u)) + epsilon_depth;
-				ry_intensity(v,u) = abs(intensity_ref(v+1,u) - intensity_ref(v,u)) + epsilon_intensity;
-            }
+    ImageDomain domain(0, rows_i, 30, 0, cols_i, 40);
 
+	//1. Weights for the gradients, 2. spatial derivatives (they need the weights of the neighbouring regions)
+    VO_SF_RegionFunctor<&VO_SF::calculateGradientWeights> delegate_weights(*this);
+    tbb::parallel_for(domain, delegate_weights);
 
-    //Spatial derivatives
-    for (unsigned int v = 0; v < rows_i; v++)
-        for (unsigned int u = 1; u < cols_i-1; u++)
-            if (Null(v,u) == false)
-            {
-                dcu(v,u) = (rx_intensity(v,u-1)*(intensity_ref(v,u+1)-intensity_ref(v,u)) + rx_intensity(v,u)*(intensity_ref(v,u) - intensity_ref(v,u-1)))/(rx_intensity(v,u)+rx_intensity(v,u-1));
-                ddu(v,u) = (rx(v,u-1)*(depth_ref(v,u+1)-depth_ref(v,u)) + rx(v,u)*(depth_ref(v,u) - depth_ref(v,u-1)))/(rx(v,u)+rx(v,u-1));
-            }
+    VO_SF_RegionFunctor<&VO_SF::calculateDerivatives> delegate_derivatives(*this);
+    tbb::parallel_for(domain, delegate_derivatives);
 
 	dcu.col(0) = dcu.col(1);
 	dcu.col(cols_i-1) = dcu.col(cols_i-2);
 	ddu.col(0) = ddu.col(1);
 	ddu.col(cols_i-1) = ddu.col(cols_i-2);
 
-    for (unsigned int u = 0; u < cols_i; u++)
-        for (unsigned int v = 1; v < rows_i-1; v++)
-            if (Null(v,u) == false)
-            {
-                dcv(v,u) = (ry_intensity(v-1,u)*(intensity_ref(v+1,u)-intensity_ref(v,u)) + ry_intensity(v,u)*(intensity_ref(v,u) - intensity_ref(v-1,u)))/(ry_intensity(v,u)+ry_intensity(v-1,u));
-                ddv(v,u) = (ry(v-1,u)*(depth_ref(v+1,u)-depth_ref(v,u)) + ry(v,u)*(depth_ref(v,u) - depth_ref(v-1,u)))/(ry(v,u)+ry(v-1,u));
-            }
-
     dcv.row(0) = dcv.row(1);
     dcv.row(rows_i-1) = dcv.row(rows_i-2);
     ddv.row(0) = ddv.row(1);
     ddv.row(rows_i-1) = ddv.row(rows_i-2);
 
 	//Temporal derivative
-	dct = intensity_warped[image_level] - intensity_old[image_level];
-    ddt = depth_warped[image_level] - depth_old[image_level];
+	dct = (identity_warp ? intensity[image_level] : intensity_warped[image_level]) - intensity_old[image_level];
+    ddt = (identity_warp ? depth[image_level] : depth_warped[image_level]) - depth_old[image_level];
+}
+
+void VO_SF::computeIdentityLevelProducts()
+{
+	//The first warping of both passes is the identity: the inter coords and the derivatives only depend on the images
+	if (identity_level_valid)
+	{
+		depth_inter[image_level] = identity_depth_inter;
+		intensity_inter[image_level] = identity_intensity_inter;
+		Null.topLeftCorner(rows_i, cols_i) = identity_Null;
+		dcu.topLeftCorner(rows_i, cols_i) = identity_dcu;
+		dcv.topLeftCorner(rows_i, cols_i) = identity_dcv;
+		ddu.topLeftCorner(rows_i, cols_i) = identity_ddu;
+		ddv.topLeftCorner(rows_i, cols_i) = identity_ddv;
+		dct = identity_dct;
+		ddt = identity_ddt;
+		return;
+	}
+
+	//The new images are read directly (instead of copying them into depth_warped and intensity_warped)
+	identity_warp = true;
+	computeCoordsParallel();
+	calculateDerivatives();
+	identity_warp = false;
+
+	identity_depth_inter = depth_inter[image_level];
+	identity_intensity_inter = intensity_inter[image_level];
+	identity_Null = Null.topLeftCorner(rows_i, cols_i);
+	identity_dcu = dcu.topLeftCorner(rows_i, cols_i);
+	identity_dcv = dcv.topLeftCorner(rows_i, cols_i);
+	identity_ddu = ddu.topLeftCorner(rows_i, cols_i);
+	identity_ddv = ddv.topLeftCorner(rows_i, cols_i);
+	identity_dct = dct;
+	identity_ddt = ddt;
+	identity_level_valid = true;
+}
+
+void VO_SF::calculateGradientWeights(cv::Rect region)
+{
+    const unsigned int x = region.tl().x, y = region.tl().y, w = region.width, h = region.height;
+
+	const MatrixXf &depth_ref = depth_inter[image_level];
+	const MatrixXf &intensity_ref = intensity_inter[image_level];
+
+    const float epsilon_intensity = 1e-6f;
+	const float epsilon_depth = 0.005f;
+
+	//Branch-free (null pixels and the last col/row get weight 1)
+    for (unsigned int u = x; u < x+w; u++)
+	{
+		const unsigned int ur = min(u+1, cols_i-1);
+        for (unsigned int v = y; v < y+h; v++)
+		{
+			const bool no_rx = Null(v,u) || (u == cols_i-1);
+			rx(v,u) = no_rx ? 1.f : abs(depth_ref(v,ur) - depth_ref(v,u)) + epsilon_depth;
+			rx_intensity(v,u) = no_rx ? 1.f : abs(intensity_ref(v,ur) - intensity_ref(v,u)) + epsilon_intensity;
+
+			const unsigned int vu = min(v+1, rows_i-1);
+			const bool no_ry = Null(v,u) || (v == rows_i-1);
+			ry(v,u) = no_ry ? 1.f : abs(depth_ref(vu,u) - depth_ref(v,u)) + epsilon_depth;
+			ry_intensity(v,u) = no_ry ? 1.f : abs(intensity_ref(vu,u) - intensity_ref(v,u)) + epsilon_intensity;
+		}
+	}
+}
+
+void VO_SF::calculateDerivatives(cv::Rect region)
+{
+    const unsigned int x = region.tl().x, y = region.tl().y, w = region.width, h = region.height;
+
+	const MatrixXf &depth_ref = depth_inter[image_level];
+	const MatrixXf &intensity_ref = intensity_inter[image_level];
+
+	//Spatial derivatives. They are also computed (without branches) for the null pixels, which are never used
+    for (unsigned int u = max(x, 1u); u < min(x+w, cols_i-1); u++)
+        for (unsigned int v = y; v < y+h; v++)
+		{
+			dcu(v,u) = (rx_intensity(v,u-1)*(intensity_ref(v,u+1)-intensity_ref(v,u)) + rx_intensity(v,u)*(intensity_ref(v,u) - intensity_ref(v,u-1)))/(rx_intensity(v,u)+rx_intensity(v,u-1));
+			ddu(v,u) = (rx(v,u-1)*(depth_ref(v,u+1)-depth_ref(v,u)) + rx(v,u)*(depth_ref(v,u) - depth_ref(v,u-1)))/(rx(v,u)+rx(v,u-1));
+		}
+
+    for (unsigned int u = x; u < x+w; u++)
+        for (unsigned int v = max(y, 1u); v < min(y+h, rows_i-1); v++)
+		{
+			dcv(v,u) = (ry_intensity(v-1,u)*(intensity_ref(v+1,u)-intensity_ref(v,u)) + ry_intensity(v,u)*(intensity_ref(v,u) - intensity_ref(v-1,u)))/(ry_intensity(v,u)+ry_intensity(v-1,u));
+			ddv(v,u) = (ry(v-1,u)*(depth_ref(v+1,u)-depth_ref(v,u)) + ry(v,u)*(depth_ref(v,u) - depth_ref(v-1,u)))/(ry(v,u)+ry(v-1,u));
+		}
 }
 
 void VO_SF::computeWeights()
 {
-    weights_c.assign(0.f);
-    weights_d.assign(0.f);
-	const MatrixXi &labels_ref = labels[image_level];
+    ImageDomain domain(0, rows_i, 30, 0, cols_i, 40);
+
+    VO_SF_RegionFunctor<&VO_SF::computeWeights> delegate(*this);
+    tbb::parallel_for(domain, delegate);
+
+	//Normalize with the max value (only the level is used, the weights are zero elsewhere)
+    const float inv_max_c = 1.f/weights_c.block(0,0,rows_i,cols_i).maxCoeff();
+    weights_c.block(0,0,rows_i,cols_i) *= inv_max_c;
+
+	const float inv_max_d = 1.f/weights_d.block(0,0,rows_i,cols_i).maxCoeff();
+    weights_d.block(0,0,rows_i,cols_i) *= inv_max_d;
+}
+
+void VO_SF::computeWeights(cv::Rect region)
+{
+    const unsigned int x = region.tl().x, y = region.tl().y, w = region.width, h = region.height;
+	const MatrixLabels &labels_ref = labels[image_level];
 	
 	//Parameters for error_linearization
     const float kduvt_c = 10.f;
 	const float kduvt_d = 200.f;
+
+	//Set measurement error
+	const float error_m_c = 1.f; 
+	const float error_m_d = 0.01f;
+
+	//Downweight uncertain regions (per label)
+	float w_dinobj_label[NUM_LABELS+1];
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		w_dinobj_label[l] = label_static[l] ? max(0.f, 1.f - b_segm[l]) : 1.f;
+	w_dinobj_label[NUM_LABELS] = 0.f;
 	
-    for (unsigned int u = 1; u < cols_i-1; u++)
+    for (unsigned int u = x; u < x+w; u++)
+		for (unsigned int v = y; v < y+h; v++)
+		{
+			//Null pixels and the image border get zero weight
+			const bool valid = !Null(v,u) && (u > 0) && (v > 0) && (u < cols_i-1) && (v < rows_i-1);
+			const float w_dinobj = valid ? w_dinobj_label[labels_ref(v,u)] : 0.f;
+
+			//Approximate linearization error
+			const float error_l_c = kduvt_c*(square(dct(v,u)) + square(dcu(v,u)) + square(dcv(v,u)));
+            const float error_l_d = kduvt_d*(square(ddt(v,u)) + square(ddu(v,u)) + square(ddv(v,u))); 
+
+            weights_c(v,u) = sqrtf(w_dinobj/(error_m_c + error_l_c));
+			weights_d(v,u) = sqrtf(w_dinobj/(error_m_d + error_l_d)); 
+		}
+}
+
+void VO_SF::selectInformativePixels(bool use_weights)
+{
+	//Refs
+	const MatrixLabels &labels_ref = labels[image_level];
+
+	//Count the valid pixels of every cluster (all of them belong to the first one if there are no clusters)
+	int count[NUM_LABELS+1];
+	for (unsigned int l=0; l<=NUM_LABELS; l++)
+		count[l] = 0;
+
+	for (unsigned int u = 1; u < cols_i-1; u++)
+		for (unsigned int v = 1; v < rows_i-1; v++)
+			if (Null(v,u) == false)
+				count[odometry_only ? 0 : labels_ref(v,u)]++;
+
+	//Clusters under budget keep all their pixels. The others keep (at most) one pixel per block, so that the selection
+	//is spread over the image, and then the best ones of these candidates up to the budget
+	const unsigned int budget = max_pixels_per_cluster;
+	unsigned int block_size[NUM_LABELS+1], block_rows[NUM_LABELS+1];
+	vector<int> best_pixel[NUM_LABELS+1];
+	vector<float> best_score[NUM_LABELS+1];
+	vector<pair<float, int> > candidates[NUM_LABELS+1];
+	for (unsigned int l=0; l<=NUM_LABELS; l++)
+	{
+		block_size[l] = max(1, int(sqrtf(float(count[l])/float(budget))));
+		block_rows[l] = rows_i/block_size[l] + 1;
+		if (block_size[l] > 1)
+		{
+			best_pixel[l].assign(block_rows[l]*(cols_i/block_size[l] + 1), -1);
+			best_score[l].assign(block_rows[l]*(cols_i/block_size[l] + 1), -1.f);
+		}
+		else if (count[l] > int(budget))
+			candidates[l].reserve(count[l]);
+	}
+
+	//Keep the pixel with the highest (weighted) gradient of every block
+	const float k_c = square(k_photometric_res);
+	for (unsigned int u = 1; u < cols_i-1; u++)
 		for (unsigned int v = 1; v < rows_i-1; v++)
-            if (Null(v,u) == false)
+		{
+			pixel_selected(v,u) = false;
+			if (Null(v,u) == true)
+				continue;
+
+			const unsigned int lab = odometry_only ? 0 : labels_ref(v,u);
+			if (count[lab] <= int(budget))
 			{
-				//Set measurement error
-				const float error_m_c = 1.f; 
-				const float error_m_d = 0.01f;
+				pixel_selected(v,u) = true;
+				continue;
+			}
 
-				//Approximate linearization error
-				const float error_l_c = kduvt_c*(square(dct(v,u)) + square(dcu(v,u)) + square(dcv(v,u)));
-                const float error_l_d = kduvt_d*(square(ddt(v,u)) + square(ddu(v,u)) + square(ddv(v,u))); 
+			float score_c = k_c*(square(dcu(v,u)) + square(dcv(v,u)));
+			float score_d = square(ddu(v,u)) + square(ddv(v,u));
+			if (use_weights)
+			{
+				score_c *= square(weights_c(v,u));
+				score_d *= square(weights_d(v,u));
+			}
 
-				//Downweight uncertain regions
-				const float w_dinobj = label_static[labels_ref(v,u)] ? max(0.f, 1.f - b_segm[labels_ref(v,u)]) : 1.f;
+			if (block_size[lab] == 1)
+			{
+				candidates[lab].push_back(make_pair(score_c + score_d, v + u*rows_i));
+				continue;
+			}
 
-                weights_c(v,u) = sqrtf(w_dinobj/(error_m_c + error_l_c));
-				weights_d(v,u) = sqrtf(w_dinobj/(error_m_d + error_l_d)); 
+			const unsigned int block = v/block_size[lab] + block_rows[lab]*(u/block_size[lab]);
+			if (score_c + score_d > best_score[lab][block])
+			{
+				best_score[lab][block] = score_c + score_d;
+				best_pixel[lab][block] = v + u*rows_i;
 			}
+		}
 
-    const float inv_max_c = 1.f/weights_c.maximum();
-    weights_c = inv_max_c*weights_c;
+	//Trim the candidates of every cluster to the budget (highest scores)
+	for (unsigned int l=0; l<=NUM_LABELS; l++)
+	{
+		for (unsigned int b=0; b<best_pixel[l].size(); b++)
+			if (best_pixel[l][b] >= 0)
+				candidates[l].push_back(make_pair(best_score[l][b], best_pixel[l][b]));
 
-	const float inv_max_d = 1.f/weights_d.maximum();
-    weights_d = inv_max_d*weights_d;
+		if (candidates[l].size() > budget)
+		{
+			nth_element(candidates[l].begin(), candidates[l].begin() + budget, candidates[l].end(), greater<pair<float, int> >());
+			candidates[l].resize(budget);
+		}
+
+		for (unsigned int c=0; c<candidates[l].size(); c++)
+			pixel_selected(candidates[l][c].second%rows_i, candidates[l][c].second/rows_i) = true;
+	}
 }
 
 
+JacobianStorage VO_SF::jacobianStorage() const
+{
+	if (recompute_jacobians_irls)
+		return STORE_NONE;
+	else
+		return STORE_FLOAT;
+}
+
+void VO_SF::solveRobustOdometryCauchy()
+{
+	if (residual_mode == RESIDUALS_BOTH)	solveRobustOdometryCauchy<2>();
+	else									solveRobustOdometryCauchy<1>();
+}
+
+template<int Rows>
 void VO_SF::solveRobustOdometryCauchy()
 {
     SolveForMotionWorkspace &ws = ws_foreground;
@@ -593,14 +779,16 @@ void VO_SF::solveRobustOdometryCauchy()
     //Create list of pixels&constraints
     for (unsigned int u = 1; u < cols_i-1; u++)
         for (unsigned int v = 1; v < rows_i-1; v++)
-            if (Null(v,u) == false)
+            if ((Null(v,u) == false)&&(!use_pixel_selection || pixel_selected(v,u)))
                 ws.indices.push_back(std::make_pair(v, u));
 
 
 	//initialize A and B for the first computation of residuals
-	float *A = ws.A, *B = ws.B;
-    JacobianElementForRobustOdometryFn fn_ini(ws,*this);
-    JacobianElementForRobustOdometryFn::Range range_ini(0, ws.indices.size(), 32);
+	const JacobianInputs inputs(*this);
+    const JacobianStorage storage = jacobianStorage();
+    ws.allocate(storage);
+    JacobianKernelFn<Rows, RobustWeighting, ResidualSumOutput<Rows> > fn_ini(ws, inputs, storage);
+    tbb::blocked_range<size_t> range_ini(0, ws.indices.size(), 32);
     const float sum_of_residuals = tbb::parallel_reduce(range_ini, 0.f, fn_ini, std::plus<float>()); // parallel version
     //float mean_res = fn(range, 0.f); // linear version
 
@@ -612,22 +800,26 @@ void VO_SF::solveRobustOdometryCauchy()
     NormalEquation::MatrixA AtA; NormalEquation::VectorB AtB;
 
 	//Aux structure for the solver
-	IrlsContext ctx;
-	ctx.residuals.resize(2*ws.indices.size(), 1);
+	IrlsContext<Rows> ctx;
 	ctx.num_pixels = ws.indices.size();
-	ctx.A = A; ctx.B = B;
+	ctx.A = ws.A; ctx.B = ws.B;
 	ctx.Cauchy_factor = 16.f; //25 before
+	if (storage == STORE_NONE)
+	{
+		ctx.inputs = &inputs;
+		ctx.indices = &ws.indices;
+	}
 	
 	for (unsigned int iter=0; iter<=max_iter_irls; iter++)
     {
         //Recompute residuals and update the Cauchy parameter
 		ctx.Var = robust_odo;
-		ctx.computeNewResiduals();
+		ctx.template computeNewResiduals<RobustWeighting>();
 		
-		//Build the system with the new weights
-        IrlsElementFn fn(ctx);
-		IrlsElementFn::Range range(0, ws.indices.size(), 32);
-        NormalEquationAndChi2 nes_and_chi2 = tbb::parallel_reduce(range, NormalEquationAndChi2(), fn, NormalEquationAndChi2::Reduce());
+		//Build the system with the new weights (fused with the computation of the residuals and their weights)
+        IrlsKernelFn<Rows, RobustWeighting, IrlsOutput<Rows> > fn(ctx, IrlsOutput<Rows>(ctx));
+		tbb::blocked_range<size_t> range(0, ws.indices.size(), 32);
+        NormalEquationAndChi2<Rows> nes_and_chi2 = tbb::parallel_reduce(range, NormalEquationAndChi2<Rows>(), fn, typename NormalEquationAndChi2<Rows>::Reduce());
 
 		//Solve the linear system of equations with least squares
         nes_and_chi2.nes.get(AtA, AtB);
@@ -651,14 +843,22 @@ void VO_SF::solveRobustOdometryCauchy()
 
 void VO_SF::solveMotionForIndices(vector<pair<int, int> > const&indices, Vector6f &twist, SolveForMotionWorkspace &ws, bool is_background)
 {
-	float *A = ws.A, *B = ws.B;
+	if (residual_mode == RESIDUALS_BOTH)	solveMotionForIndices<2>(indices, twist, ws, is_background);
+	else									solveMotionForIndices<1>(indices, twist, ws, is_background);
+}
 
-	JacobianElementFn fn_ini(ws,*this);
-	JacobianElementFn::Range range_ini(0, indices.size(), 32);
+template<int Rows>
+void VO_SF::solveMotionForIndices(vector<pair<int, int> > const&indices, Vector6f &twist, SolveForMotionWorkspace &ws, bool is_background)
+{
+	const JacobianInputs inputs(*this);
+	const JacobianStorage storage = jacobianStorage();
+	ws.allocate(storage);
+	JacobianKernelFn<Rows, PreWeighting, AccumulateOutput<Rows> > fn_ini(ws, inputs, storage);
+	tbb::blocked_range<size_t> range_ini(0, indices.size(), 32);
 	NormalEquation::MatrixA AtA; NormalEquation::VectorB AtB;
 
 	//Solve it once only with pre-weighting
-	NormalEquationAndChi2 nes_and_chi2_ini = tbb::parallel_reduce(range_ini, NormalEquationAndChi2(), fn_ini, NormalEquationAndChi2::Reduce()); // parallel version
+	NormalEquationAndChi2<Rows> nes_and_chi2_ini = tbb::parallel_reduce(range_ini, NormalEquationAndChi2<Rows>(), fn_ini, typename NormalEquationAndChi2<Rows>::Reduce()); // parallel version
 	//NormalEquationAndChi2 nes_and_chi2 = fn(range, NormalEquationAndChi2()); // linear version
 	nes_and_chi2_ini.nes.get(AtA, AtB);
 	twist = AtA.ldlt().solve(-AtB);
@@ -669,22 +869,26 @@ void VO_SF::solveMotionForIndices(vector<pair<int, int> > const&indices, Vector6
 	float chi2_last = numeric_limits<float>::max(); 
 
 	//Aux structure for the solver
-	IrlsContext ctx;
-	ctx.residuals.resize(2*indices.size(), 1);
+	IrlsContext<Rows> ctx;
 	ctx.num_pixels = indices.size();
-	ctx.A = A; ctx.B = B;
+	ctx.A = ws.A; ctx.B = ws.B;
 	ctx.Cauchy_factor = is_background ? 0.25f : 1.f;
+	if (storage == STORE_NONE)
+	{
+		ctx.inputs = &inputs;
+		ctx.indices = &indices;
+	}
 
 	for (unsigned int it=1; it<=max_iter_irls; it++)
 	{	
 		//Recompute residuals and update the Cauchy parameter
 		ctx.Var = twist;
-		ctx.computeNewResiduals();
+		ctx.template computeNewResiduals<PreWeighting>();
 		
-		//Build the system with the new weights
-		IrlsElementFn fn(ctx);
-		IrlsElementFn::Range range(0, indices.size(), 32);
-		NormalEquationAndChi2 nes_and_chi2 = tbb::parallel_reduce(range, NormalEquationAndChi2(), fn, NormalEquationAndChi2::Reduce());
+		//Build the system with the new weights (fused with the computation of the residuals and their weights)
+		IrlsKernelFn<Rows, PreWeighting, IrlsOutput<Rows> > fn(ctx, IrlsOutput<Rows>(ctx));
+		tbb::blocked_range<size_t> range(0, indices.size(), 32);
+		NormalEquationAndChi2<Rows> nes_and_chi2 = tbb::parallel_reduce(range, NormalEquationAndChi2<Rows>(), fn, typename NormalEquationAndChi2<Rows>::Reduce());
 		
 		//Solve the linear system of equations with least squares
 		nes_and_chi2.nes.get(AtA, AtB);
@@ -704,6 +908,12 @@ void VO_SF::solveMotionForIndices(vector<pair<int, int> > const&indices, Vector6
 
 void VO_SF::solveMotionAllClusters()
 {
+	if (use_single_sweep_clusters && (residual_mode == RESIDUALS_BOTH))
+	{
+		solveMotionAllClustersSingleSweep();
+		return;
+	}
+
     MemberFunctor<VO_SF, &VO_SF::solveMotionDynamicClusters> solve_motion_dyn_clusters(*this);
     MemberFunctor<VO_SF, &VO_SF::solveMotionStaticClusters> solve_motion_stat_clusters(*this);
 
@@ -716,6 +926,141 @@ void VO_SF::solveMotionAllClusters()
 	else				tbb::parallel_invoke(solve_motion_stat_clusters, solve_motion_dyn_clusters); //only helps if there is more than one motion
 }
 
+void VO_SF::solveMotionAllClustersSingleSweep()
+{
+	const float in_threshold = 0.2f;
+	const bool solve_dynamic = (level > 0); //At the first level we only compute the odometry
+
+	//Refs
+	const Matrix<float, NUM_LABELS+1, Dynamic> &labels_ref = label_funct[image_level];
+	SolveForMotionWorkspace &ws = ws_background;
+	vector<pair<int,int> > &indices = ws.indices;
+
+	//Create the list of pixels and the slots (clusters) that every one of them contributes to
+	MultiClusterContext ctx;
+	float num_entries[NumSlots];
+	for (unsigned int s=0; s<NumSlots; s++)
+	{
+		num_entries[s] = 0.f;
+		ctx.twist[s].setZero();
+		ctx.active[s] = (s == BackgroundSlot) || (solve_dynamic && label_dynamic[s]);
+	}
+
+	indices.clear();
+	ctx.first_slot.reserve(rows_i*cols_i + 1);
+	ctx.background_mult.reserve(rows_i*cols_i);
+	for (unsigned int u = 1; u < cols_i-1; u++)
+		for (unsigned int v = 1; v < rows_i-1; v++)
+			if ((Null(v,u) == false)&&(!use_pixel_selection || pixel_selected(v,u)))
+			{
+				const unsigned int first = ctx.slots.size();
+				unsigned int mult = 0;
+				for (unsigned int l=0; l<NUM_LABELS; l++)
+					if (labels_ref(l,v+u*rows_i) > in_threshold)
+					{
+						if (label_static[l])
+							mult++;
+						if (solve_dynamic && label_dynamic[l])
+						{
+							ctx.slots.push_back(l);
+							num_entries[l] += 1.f;
+						}
+					}
+
+				if (mult > 0)
+				{
+					ctx.slots.push_back(BackgroundSlot);
+					num_entries[BackgroundSlot] += mult;
+				}
+
+				if (ctx.slots.size() > first)
+				{
+					indices.push_back(make_pair(v,u));
+					ctx.first_slot.push_back(first);
+					ctx.background_mult.push_back(mult);
+				}
+			}
+	ctx.first_slot.push_back(ctx.slots.size());
+
+	//Jacobians (stored or recomputed later) and pre-weighted solution of every slot
+	const JacobianInputs inputs(*this);
+	const JacobianStorage storage = jacobianStorage();
+	ws.allocate(storage);
+	IrlsContext<2> &jac = ctx.jacobians;
+	jac.A = ws.A; jac.B = ws.B;
+	if (storage == STORE_NONE)
+	{
+		jac.inputs = &inputs;
+		jac.indices = &indices;
+	}
+
+	const tbb::blocked_range<size_t> range(0, indices.size(), 32);
+	NormalEquation::MatrixA AtA; NormalEquation::VectorB AtB;
+	JacobianKernelFn<2, PreWeighting, MultiClusterOutput> fn_ini(ws, inputs, storage, MultiClusterOutput(ctx));
+	MultiClusterNormalEquations nes_ini = tbb::parallel_reduce(range, MultiClusterNormalEquations(), fn_ini, MultiClusterNormalEquations::Reduce());
+	for (unsigned int s=0; s<NumSlots; s++)
+		if (ctx.active[s])
+		{
+			nes_ini.nes[s].get(AtA, AtB);
+			ctx.twist[s] = AtA.ldlt().solve(-AtB);
+		}
+
+
+	//Solve IRLS (Cauchy robust penalty) for all the slots at once
+	//===================================================================
+	float chi2_last[NumSlots];
+	for (unsigned int s=0; s<NumSlots; s++)
+		chi2_last[s] = numeric_limits<float>::max();
+
+	for (unsigned int it=1; it<=max_iter_irls; it++)
+	{
+		//Recompute residuals and update the Cauchy parameters
+		IrlsKernelFn<2, PreWeighting, MultiClusterResidualsOutput> fn_res(jac, MultiClusterResidualsOutput(ctx));
+		const MultiClusterResiduals res = tbb::parallel_reduce(range, MultiClusterResiduals(), fn_res, MultiClusterResiduals::Reduce());
+		for (unsigned int s=0; s<NumSlots; s++)
+		{
+			const float Cauchy_factor = (s == BackgroundSlot) ? 0.25f : 1.f;
+			const float mean_res = max(1e-5f, res.sum[s]/(2.f*num_entries[s]));
+			ctx.k_Cauchy[s] = Cauchy_factor/(mean_res*mean_res);
+		}
+
+		//Build the systems with the new weights
+		IrlsKernelFn<2, PreWeighting, MultiClusterOutput> fn(jac, MultiClusterOutput(ctx, true));
+		MultiClusterNormalEquations nes = tbb::parallel_reduce(range, MultiClusterNormalEquations(), fn, MultiClusterNormalEquations::Reduce());
+
+		//Solve them and check convergence (independently for every slot)
+		bool any_active = false;
+		for (unsigned int s=0; s<NumSlots; s++)
+			if (ctx.active[s])
+			{
+				nes.nes[s].get(AtA, AtB);
+				const Vector6f twist_new = AtA.ldlt().solve(-AtB);
+				const Vector6f twist_delta = ctx.twist[s] - twist_new;
+				ctx.twist[s] = twist_new;
+
+				const float chi2_ratio = nes.chi2[s]/max(1e-10f, chi2_last[s]);
+				if (chi2_ratio > irls_chi2_decrement_threshold || twist_delta.lpNorm<Infinity>() < irls_delta_threshold)
+					ctx.active[s] = false;
+
+				chi2_last[s] = nes.chi2[s];
+				any_active |= ctx.active[s];
+			}
+
+		if (!any_active)
+			break;
+	}
+
+	//Save the solutions
+	computeTransformationFromTwist(ctx.twist[BackgroundSlot], true);
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+	{
+		if ((label_static[l])&&(!label_dynamic[l])) 
+			computeTransformationFromTwist(ctx.twist[BackgroundSlot], false, l);
+		else if (solve_dynamic && label_dynamic[l])
+			computeTransformationFromTwist(ctx.twist[l], false, l);
+	}
+}
+
 void VO_SF::solveMotionDynamicClusters()
 {
     const float in_threshold = 0.2f;
@@ -735,7 +1080,7 @@ void VO_SF::solveMotionDynamicClusters()
 
         for (unsigned int u = 1; u < cols_i-1; u++)
             for (unsigned int v = 1; v < rows_i-1; v++)
-                if ((Null(v,u) == false)&&(labels_ref(l,v+u*rows_i) > in_threshold))
+                if ((Null(v,u) == false)&&(labels_ref(l,v+u*rows_i) > in_threshold)&&(!use_pixel_selection || pixel_selected(v,u)))
                     indices.push_back(make_pair(v,u));
 
 		//Solve
@@ -764,7 +1109,7 @@ void VO_SF::solveMotionStaticClusters()
 
         for (unsigned int u = 1; u < cols_i-1; u++)
             for (unsigned int v = 1; v < rows_i-1; v++)
-                if ((Null(v,u) == false)&&(labels_ref(l,v+u*rows_i) > in_threshold))
+                if ((Null(v,u) == false)&&(labels_ref(l,v+u*rows_i) > in_threshold)&&(!use_pixel_selection || pixel_selected(v,u)))
                     indices.push_back(make_pair(v,u));
 	}
 
@@ -789,29 +1134,21 @@ void VO_SF::updateCameraPoseFromOdometry()
 
 void VO_SF::computeTransformationFromTwist(Vector6f &twist, bool is_odometry, unsigned int label)
 {
-	Matrix4f local_mat = Matrix4f::Zero();
-
-	//Compute the rigid transformation associated to the twist
-	local_mat(0,1) = -twist(5); local_mat(1,0) = twist(5);
-	local_mat(0,2) = twist(4); local_mat(2,0) = -twist(4);
-	local_mat(1,2) = -twist(3); local_mat(2,1) = twist(3);
-	local_mat(0,3) = twist(0); local_mat(1,3) = twist(1); local_mat(2,3) = twist(2);
+	//Compute the rigid transformation associated to the twist (closed form)
+	const Matrix4f local_mat = se3::exp(twist);
 
 	//If odometry, update the transformation and the velocity
 	if (is_odometry)
 	{
 		twist_level_odometry = twist;
-		T_odometry = local_mat.exp()*T_odometry;
-
-		Matrix4f log_trans = T_odometry.log();
-		twist_odometry(0) = log_trans(0,3); twist_odometry(1) = log_trans(1,3); twist_odometry(2) = log_trans(2,3);
-        twist_odometry(3) = -log_trans(1,2); twist_odometry(4) = log_trans(0,2); twist_odometry(5) = -log_trans(0,1);
+		T_odometry = se3::compose(local_mat, T_odometry);
+		twist_odometry = se3::log(T_odometry);
 	}
 
 	//If moving cluster, just update its transformation (velocity not used)
 	else
 	{
-		T_clusters[label] = local_mat.exp()*T_clusters[label];	
+		T_clusters[label] = se3::compose(local_mat, T_clusters[label]);
 	}
 }
 
@@ -820,6 +1157,10 @@ void VO_SF::warpImagesParallel()
 {
     ImageDomain domain(0, rows_i, 30, 0, cols_i, 40);
 
+    //Compute the inverse rigid transformation associated to the labels
+    for (unsigned int l=0; l<NUM_LABELS; l++)
+        T_clusters_inv[l] = se3::inverse(T_clusters[l]);
+
     typedef VO_SF_RegionFunctor<&VO_SF::warpImages> WarpImagesDelegate;
     WarpImagesDelegate warp_images(*this);
     tbb::parallel_for(domain, warp_images);
@@ -836,6 +1177,9 @@ void VO_SF::computeCoordsParallel()
 
 void VO_SF::warpImages()
 {
+    for (unsigned int l=0; l<NUM_LABELS; l++)
+        T_clusters_inv[l] = se3::inverse(T_clusters[l]);
+
     warpImages(cv::Rect(0,0, cols_i, rows_i));
 }
 
@@ -844,80 +1188,67 @@ void VO_SF::warpImages(cv::Rect region)
     const unsigned int x = region.tl().x, y = region.tl().y, w = region.width, h = region.height;
 
     //Camera parameters (which also depend on the level resolution)
-    const float f = float(cols_i)/(2.f*tan(0.5f*fovh));
-    const float inv_f_i = 1.f/f;
-    const float disp_u_i = 0.5f*float(cols_i-1);
-    const float disp_v_i = 0.5f*float(rows_i-1);
+    const LevelIntrinsics &intr = intrinsics[image_level];
 
 	//Refs
 	MatrixXf &depth_warped_ref = depth_warped[image_level];
 	MatrixXf &intensity_warped_ref = intensity_warped[image_level];
-	MatrixXf &xx_warped_ref = xx_warped[image_level];
-	MatrixXf &yy_warped_ref = yy_warped[image_level];
-	const MatrixXf &depth_old_ref = depth_old[image_level];
-	const MatrixXf &xx_old_ref = xx_old[image_level];
-	const MatrixXf &yy_old_ref = yy_old[image_level];
-	const Matrix<float, NUM_LABELS+1, Dynamic> &labels_ref = label_funct[image_level];
-
-	//Initialize
-	depth_warped_ref.block(y, x, h, w).assign(0.f);
-    xx_warped_ref.block(y, x, h, w).assign(0.f);
-    yy_warped_ref.block(y, x, h, w).assign(0.f);
-    intensity_warped_ref.block(y, x, h, w).assign(0.f);
-
-    //Compute the inverse rigid transformation associated to the labels
-    Matrix4f inv_trans[NUM_LABELS];
-    for (unsigned int l=0; l<NUM_LABELS; l++)
-		inv_trans[l] = T_clusters[l].inverse();
 
 	//Fast warping
     for (unsigned int j = x; j < x + w; j++)
         for (unsigned int i = y; i< y + h; i++)
-        {
-            const int pixel_label = i+j*rows_i;
-			const float z = depth_old_ref(i,j);
-            if ((z > 0.f)&&(labels_ref(NUM_LABELS, pixel_label) != 1.f))
-            {
-                //Interpolate between the transformations (not correct but faster and works)
-                Matrix4f trans = Matrix4f::Zero();
-                for (unsigned int l=0; l<=NUM_LABELS; l++)
-                    if (labels_ref(l,pixel_label) != 0.f)
-                        trans += labels_ref(l,pixel_label)*inv_trans[l];
-
-                //Transform point to the warped reference frame
-                const float depth_w = trans(0,0)*z + trans(0,1)*xx_old_ref(i,j) + trans(0,2)*yy_old_ref(i,j) + trans(0,3);
-                const float x_w = trans(1,0)*z + trans(1,1)*xx_old_ref(i,j) + trans(1,2)*yy_old_ref(i,j) + trans(1,3);
-                const float y_w = trans(2,0)*z + trans(2,1)*xx_old_ref(i,j) + trans(2,2)*yy_old_ref(i,j) + trans(2,3);
-
-                //Calculate warping
-                const float uwarp = f*x_w/depth_w + disp_u_i;
-                const float vwarp = f*y_w/depth_w + disp_v_i;
-                interpolateColorAndDepthAcu(intensity_warped_ref(i,j), depth_warped_ref(i,j), uwarp, vwarp);
-                if (depth_warped_ref(i,j) != 0.f)
-                    depth_warped_ref(i,j) -= (depth_w-z);
-
-                xx_warped_ref(i,j) = (j - disp_u_i)*depth_warped_ref(i,j)*inv_f_i;
-                yy_warped_ref(i,j) = (i - disp_v_i)*depth_warped_ref(i,j)*inv_f_i;
-            }
-        }
+            warpPixel(i, j, intr, intensity_warped_ref(i,j), depth_warped_ref(i,j));
+}
+
+void VO_SF::warpPixel(unsigned int i, unsigned int j, const LevelIntrinsics &intr, float &c, float &d)
+{
+	//Refs
+	const MatrixXf &depth_old_ref = depth_old[image_level];
+	const Matrix<float, NUM_LABELS+1, Dynamic> &labels_ref = label_funct[image_level];
+
+    const int pixel_label = i+j*rows_i;
+	const float z = depth_old_ref(i,j);
+    if ((z > 0.f)&&(labels_ref(NUM_LABELS, pixel_label) != 1.f))
+    {
+        //Interpolate between the transformations (not correct but faster and works)
+        Matrix4f trans = Matrix4f::Zero();
+        for (unsigned int l=0; l<NUM_LABELS; l++)
+            if (labels_ref(l,pixel_label) != 0.f)
+                trans += labels_ref(l,pixel_label)*T_clusters_inv[l];
+
+        //Transform point to the warped reference frame
+        const float x = intr.x(z, j), y = intr.y(z, i);
+        const float depth_w = trans(0,0)*z + trans(0,1)*x + trans(0,2)*y + trans(0,3);
+        const float x_w = trans(1,0)*z + trans(1,1)*x + trans(1,2)*y + trans(1,3);
+        const float y_w = trans(2,0)*z + trans(2,1)*x + trans(2,2)*y + trans(2,3);
+
+        //Calculate warping
+        const float uwarp = intr.f*x_w/depth_w + intr.disp_u;
+        const float vwarp = intr.f*y_w/depth_w + intr.disp_v;
+        interpolateColorAndDepthAcu(c, d, uwarp, vwarp);
+        if (d != 0.f)
+            d -= (depth_w-z);
+    }
+	else
+	{
+		c = 0.f;
+		d = 0.f;
+	}
 }
 
 void VO_SF::warpImagesAccurate()
 {
 	//Camera parameters (which also depend on the level resolution)
-	const float f = float(cols_i)/(2.f*tan(0.5f*fovh));
-	const float disp_u_i = 0.5f*float(cols_i-1);
-	const float disp_v_i = 0.5f*float(rows_i-1);
+	const LevelIntrinsics &intr = intrinsics[image_level];
+	const float f = intr.f;
+	const float disp_u_i = intr.disp_u;
+	const float disp_v_i = intr.disp_v;
 
 	//Refs
 	MatrixXf &depth_warped_ref = depth_warped[image_level];
 	MatrixXf &intensity_warped_ref = intensity_warped[image_level];
-	MatrixXf &xx_warped_ref = xx_warped[image_level];
-	MatrixXf &yy_warped_ref = yy_warped[image_level];
 	const MatrixXf &depth_ref = depth[image_level];
 	const MatrixXf &intensity_ref = intensity[image_level];
-	const MatrixXf &xx_ref = xx[image_level];
-	const MatrixXf &yy_ref = yy[image_level];
 	depth_warped_ref.assign(0.f);
 	intensity_warped_ref.assign(0.f);
 
@@ -936,9 +1267,10 @@ void VO_SF::warpImagesAccurate()
 			{
 				//Transform point to the warped reference frame
 				const float intensity_w = intensity_ref(i,j);
-				const float depth_w = T_odometry(0)*z + T_odometry(4)*xx_ref(i,j) + T_odometry(8)*yy_ref(i,j) + T_odometry(12);
-				const float x_w = T_odometry(1)*z + T_odometry(5)*xx_ref(i,j) + T_odometry(9)*yy_ref(i,j) + T_odometry(13);
-				const float y_w = T_odometry(2)*z + T_odometry(6)*xx_ref(i,j) + T_odometry(10)*yy_ref(i,j) + T_odometry(14);
+				const float x = intr.x(z, j), y = intr.y(z, i);
+				const float depth_w = T_odometry(0)*z + T_odometry(4)*x + T_odometry(8)*y + T_odometry(12);
+				const float x_w = T_odometry(1)*z + T_odometry(5)*x + T_odometry(9)*y + T_odometry(13);
+				const float y_w = T_odometry(2)*z + T_odometry(6)*x + T_odometry(10)*y + T_odometry(14);
 
 				//Calculate warping
 				const int uwarp = int(100.f*(f*x_w/depth_w + disp_u_i));
@@ -995,54 +1327,67 @@ void VO_SF::warpImagesAccurate()
 			}
 		}
 
-	//Scale the averaged depth and compute spatial coordinates
-	const float inv_f_i = 1.f/f;
+	//Scale the averaged depth
 	for (unsigned int u = 0; u<cols_i; u++)
 		for (unsigned int v = 0; v<rows_i; v++)
-		{ 
 			if (wacu(v,u) != 0)
 			{
 				intensity_warped_ref(v,u) /= float(wacu(v,u));
 				depth_warped_ref(v,u) /= float(wacu(v,u));
-				xx_warped_ref(v,u) = (u - disp_u_i)*depth_warped_ref(v,u)*inv_f_i;
-				yy_warped_ref(v,u) = (v - disp_v_i)*depth_warped_ref(v,u)*inv_f_i;
 			}
-			else
-			{
-				xx_warped_ref(v,u) = 0.f;
-				yy_warped_ref(v,u) = 0.f;
-			}
-		}
 }
 
 
-void VO_SF::run_VO_SF(bool create_image_pyr)
+void VO_SF::setMotionPrior(const Matrix4f &T)
 {
-	CTicTac clock; clock.Tic();
-	
-	//Create the image pyramid if it has not been computed yet
-    //----------------------------------------------------------------------------------
-	if (create_image_pyr) 
-		createImagePyramid();
+	//The prior is used by all the passes of the next frame, afterwards motion_prior applies again.
+	//Set motion_prior = PRIOR_EXTERNAL to keep using T_odometry_prior on every frame.
+	T_odometry_prior = T;
+	prior_pending = true;
+}
 
-    //Create labels
-    //----------------------------------------------------------------------------------
-    //Kmeans
-	kMeans3DCoord();
+bool VO_SF::initializeMotionFromPrior()
+{
+	//Initialize the overall transformations to 0
+	T_odometry.setIdentity();
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		T_clusters[l].setIdentity();
 
-	//Create the pyramid for the labels
-	createLabelsPyramidUsingKMeans();
+	//Warm start with the prior given externally or with the last estimate (constant velocity)
+	if (prior_pending || (motion_prior == PRIOR_EXTERNAL))
+		T_odometry = T_odometry_prior;
+	else if ((motion_prior == PRIOR_CONSTANT_VELOCITY)&&(last_motion_valid))
+		T_odometry = T_odometry_last;
+	else
+		return false;
 
-	//Compute warped b_segmentation (necessary for the robust estimation)
-	computeSegTemporalRegValues();
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		T_clusters[l] = T_odometry;
 
+	return true;
+}
 
-    //Solve a robust odometry problem to segment the background (coarse-to-fine)
-    //---------------------------------------------------------------------------------
-    //Initialize the overall transformations to 0
-	T_odometry.setIdentity();
-    for (unsigned int l=0; l<NUM_LABELS; l++)
-        T_clusters[l].setIdentity();
+bool VO_SF::warmStartTrackedClusters()
+{
+	if (!use_cluster_tracking || !last_motion_valid || !last_clusters_valid)
+		return false;
+
+	//Only the dynamic clusters (the static ones share the motion of the background)
+	bool any_warm_start = false;
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		if (label_dynamic[l] && (cluster_match[l] >= 0))
+		{
+			T_clusters[l] = T_clusters_last[cluster_match[l]];
+			any_warm_start = true;
+		}
+
+	return any_warm_start;
+}
+
+void VO_SF::solveRobustOdometryCoarseToFine()
+{
+    //Initialize the overall transformations (to 0 or to the motion prior)
+	const bool warm_start = initializeMotionFromPrior();
 
     //Coarse-to-fine
     for (unsigned int i=0; i<ctf_levels; i++)
@@ -1053,22 +1398,24 @@ void VO_SF::run_VO_SF(bool create_image_pyr)
 			cols_i = cols/s; rows_i = rows/s;
 			image_level = ctf_levels - i + round(log2(width/cols)) - 1;
 
-			//1. Perform warping
-			if (i == 0)
+			//1. Perform warping (only needed at the first level if the motion was initialized with a prior)
+			if ((i == 0)&&(!warm_start))
 			{
-				depth_warped[image_level] = depth[image_level];
-				intensity_warped[image_level] = intensity[image_level];
-				xx_warped[image_level] = xx[image_level];
-				yy_warped[image_level] = yy[image_level];
+				//2-3. No motion: inter coords and derivatives computed once per frame
+				computeIdentityLevelProducts();
 			}
-			else 
+			else
+			{
                 warpImagesAccurate(); // forward warping, more precise
 
-			//2. Compute inter coords (better linearization of the range and optical flow constraints)
-			computeCoordsParallel();
+				//2. Compute inter coords (better linearization of the range and optical flow constraints)
+				computeCoordsParallel();
 
-			//3. Compute derivatives
-			calculateDerivatives();
+				//3. Compute derivatives
+				calculateDerivatives();
+			}
+			if (use_pixel_selection)
+				selectInformativePixels(false);
 
 			//4. Solve odometry
 			solveRobustOdometryCauchy();
@@ -1077,17 +1424,13 @@ void VO_SF::run_VO_SF(bool create_image_pyr)
 			if (twist_level_odometry.norm() < 0.04f)
 				break;
 		}
+}
 
-	//Segment static and dynamic parts
-	segmentStaticDynamic();
-
-
-	//Solve the multi-odometry problem (coarse-to-fine)
-	//-------------------------------------------------------------------------------------
-	//Set the overall transformations to 0
-	T_odometry.setIdentity();
-    for (unsigned int l=0; l<NUM_LABELS; l++)
-        T_clusters[l].setIdentity();
+void VO_SF::solveMultiOdometryCoarseToFine()
+{
+	//Set the overall transformations (to 0, to the motion prior or to the last motion of the tracked clusters)
+	const bool warm_start_prior = initializeMotionFromPrior();
+	const bool warm_start = warmStartTrackedClusters() || warm_start_prior;
 
 	//Coarse-to-fine
     for (unsigned int i=0; i<ctf_levels; i++)
@@ -1100,42 +1443,99 @@ void VO_SF::run_VO_SF(bool create_image_pyr)
 		//1. Perform warping
 		//Info: The accuracy of the odometry is slightly better using the other warping but I cannot use it here because
 		// the labels are defined in the old image (better about 7% for the only sequence I have tested)
-		if (i == 0)
+		if ((i == 0)&&(!warm_start))
 		{
-			depth_warped[image_level] = depth[image_level];
-			intensity_warped[image_level] = intensity[image_level];
-			xx_warped[image_level] = xx[image_level];
-			yy_warped[image_level] = yy[image_level];
+			//2-3. No motion: inter coords and derivatives shared with the robust odometry pass
+			computeIdentityLevelProducts();
+
+			//4. Compute weights
+			computeWeights();
 		}
 		else
+		{
 			warpImagesParallel();
 
-		//2. Compute inter coords
-		computeCoordsParallel();
+			//2. Compute inter coords
+			computeCoordsParallel();
+
+			//3. Compute derivatives
+			calculateDerivatives();
 
-		//3. Compute derivatives
-		calculateDerivatives();
+			//4. Compute weights
+			computeWeights();
+		}
 
-		//4. Compute weights
-		computeWeights();
+		if (use_pixel_selection)
+			selectInformativePixels(true);
 
 		//5. Solve odometry
 		solveMotionAllClusters();
     }
 
-	//Update camera pose from the "static" motion estimate
-	updateCameraPoseFromOdometry();
+	//Save the solution to warm-start the next frame
+	saveLastMotion();
+}
 
-	//Refine static/dynamic segmentation and warp it to use it in the next iteration
-	segmentStaticDynamic();
-	warpStaticDynamicSegmentation();
+void VO_SF::saveLastMotion()
+{
+	T_odometry_last = T_odometry;
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		T_clusters_last[l] = T_clusters[l];
+	last_motion_valid = true;
 
-    //Compute the scene flow from the rigid motions and the labels
-	computeSceneFlowFromRigidMotions();
+	//A prior given with setMotionPrior() is only used for the frame that has just been solved
+	prior_pending = false;
+
+	//The clusters are not computed in the odometry-only mode
+	kmeans_last = kmeans;
+	size_kmeans_last = size_kmeans;
+	last_clusters_valid = !odometry_only;
+}
+
+void VO_SF::run_VO_SF(bool create_image_pyr)
+{
+	CTicTac clock; clock.Tic();
+	
+	//Create the image pyramid if it has not been computed yet
+    //----------------------------------------------------------------------------------
+	if (create_image_pyr) 
+		createImagePyramid();
+
+	//Fast path: robust odometry only
+	//----------------------------------------------------------------------------------
+	if (odometry_only)
+	{
+		solveRobustOdometryCoarseToFine();
+		for (unsigned int l=0; l<NUM_LABELS; l++)
+			T_clusters[l] = T_odometry;
+		saveLastMotion();
+		updateCameraPoseFromOdometry();
+
+		//Keep the last segmentation aligned with the images for the next frame
+		if (odometry_only_reuse_segm)
+			warpStaticDynamicSegmentationWithOdometry();
+
+		//The labels of the last clustering are no longer aligned with depth_old
+		clustering_state_valid = false;
+
+		for (unsigned int c=0; c<3; c++)
+			motionfield[c].setZero();
+
+		const float runtime = 1000.f*clock.Tac();
+		printf("\nRuntime = %f (ms) odometry only\n", runtime);
+		return;
+	}
+
+	//Clustering, segmentation and motion estimation (the first two can be reused if nothing changes)
+    //----------------------------------------------------------------------------------
+	const FrameReuse reuse = use_motion_gating ? gateFrame() : REUSE_NONE;
+	runStages(reuse);
 
     //Show runtime
     const float runtime = 1000.f*clock.Tac();
     printf("\nRuntime = %f (ms) ", runtime);
+	if (reuse == REUSE_CLUSTERS)			printf("reusing the clusters, ");
+	else if (reuse == REUSE_SEGMENTATION)	printf("reusing the clusters and the segmentation, ");
     if (create_image_pyr)	printf("including the image pyramid\n");
     else					printf("without including the image pyramid\n");
 }
@@ -1147,137 +1547,157 @@ void VO_SF::run_VO_SF_TP ( bool create_image_pyr )
     if (create_image_pyr)
         createImagePyramid();
 
-    //Create labels
+    //Clustering, segmentation and motion estimation (the first two can be reused if nothing changes)
     //----------------------------------------------------------------------------------
-    //Kmeans
-    kMeans3DCoord();
-
-    //Create the pyramid for the labels
-    createLabelsPyramidUsingKMeans();
-
-    //Compute warped b_segmentation (necessary for the robust estimation)
-    computeSegTemporalRegValues();
-
-
-    //Solve a robust odometry problem to segment the background (coarse-to-fine)
-    //---------------------------------------------------------------------------------
-    //Initialize the overall transformations to 0
-    T_odometry.setIdentity();
-    for (unsigned int l=0; l<NUM_LABELS; l++)
-        T_clusters[l].setIdentity();
-
-    //Coarse-to-fine
-    for (unsigned int i=0; i<ctf_levels; i++)
-        for (unsigned int k=0; k<max_iter_per_level; k++)
-        {
-            level = i;
-            unsigned int s = pow(2.f,int(ctf_levels-(i+1)));
-            cols_i = cols/s; rows_i = rows/s;
-            image_level = ctf_levels - i + round(log2(width/cols)) - 1;
+    runStages(use_motion_gating ? gateFrame() : REUSE_NONE);
+}
 
-            //1. Perform warping
-            if (i == 0)
-            {
-                depth_warped[image_level] = depth[image_level];
-                intensity_warped[image_level] = intensity[image_level];
-                xx_warped[image_level] = xx[image_level];
-                yy_warped[image_level] = yy[image_level];
-            }
-            else
-                warpImagesAccurate(); // forward warping, more precise
+//Mean absolute difference between two coarse images (depth and intensity), relative to the thresholds.
+//Only the pixels with depth in both images are compared, it returns -1 if there are none
+static float meanImageChange(const MatrixXf &depth_a, const MatrixXf &intensity_a, const MatrixXf &depth_b, const MatrixXf &intensity_b,
+							float depth_threshold, float intensity_threshold)
+{
+	float sum_depth = 0.f, sum_intensity = 0.f;
+	unsigned int num_pixels = 0;
+	for (unsigned int u=0; u<depth_a.cols(); u++)
+		for (unsigned int v=0; v<depth_a.rows(); v++)
+			if ((depth_a(v,u) != 0.f)&&(depth_b(v,u) != 0.f))
+			{
+				sum_depth += abs(depth_a(v,u) - depth_b(v,u));
+				sum_intensity += abs(intensity_a(v,u) - intensity_b(v,u));
+				num_pixels++;
+			}
 
-            //2. Compute inter coords (better linearization of the range and optical flow constraints)
-            computeCoordsParallel();
+	if (num_pixels == 0)
+		return -1.f;
 
-            //3. Compute derivatives
-            calculateDerivatives();
+	return max(sum_depth/(num_pixels*depth_threshold), sum_intensity/(num_pixels*intensity_threshold));
+}
 
-            //4. Solve odometry
-            solveRobustOdometryCauchy();
+VO_SF::FrameReuse VO_SF::gateFrame()
+{
+	gated_frames++;
+	if (!last_clusters_valid)
+		return REUSE_NONE;
+
+	//The labels are computed on the old images. They can be reused if the current old images (coarsest level)
+	//barely differ from the ones that were clustered, which may be several frames back if they were reused before
+	const unsigned int coarse_level = ctf_levels - 1 + round(log2(width/cols));
+	const MatrixXf &depth_old_ref = depth_old[coarse_level], &intensity_old_ref = intensity_old[coarse_level];
+	if ((gating_depth_clustered.rows() != depth_old_ref.rows())||(gating_depth_clustered.cols() != depth_old_ref.cols()))
+		return REUSE_NONE;
+
+	const float change_clusters = meanImageChange(depth_old_ref, intensity_old_ref, gating_depth_clustered, gating_intensity_clustered,
+												gating_depth_threshold, gating_intensity_threshold);
+	if ((change_clusters < 0.f)||(change_clusters >= 1.f))
+		return REUSE_NONE;
+
+	gated_clusters_reused++;
+
+	//The segmentation is only reused if the new images barely differ from the old ones too (assuming that the camera has not moved)
+	const float change_frame = meanImageChange(depth[coarse_level], intensity[coarse_level], depth_old_ref, intensity_old_ref,
+												gating_depth_threshold, gating_intensity_threshold);
+	if ((change_frame < 0.f)||(max(change_clusters, change_frame) >= gating_segmentation_ratio))
+		return REUSE_CLUSTERS;
+
+	gated_segmentation_reused++;
+	return REUSE_SEGMENTATION;
+}
 
-            //Check convergence of nonlinear iterations
-            if (twist_level_odometry.norm() < 0.04f)
-                break;
-        }
+void VO_SF::runStages(FrameReuse reuse)
+{
+    //Create labels
+    //----------------------------------------------------------------------------------
+	if (reuse == REUSE_NONE)
+	{
+		//Kmeans
+		kMeans3DCoord();
+		if (use_cluster_tracking)
+			trackClusters();
 
-    //Segment static and dynamic parts
-    segmentStaticDynamic();
+		//Keep the coarsest level of the clustered images to know later whether the labels still fit them
+		if (use_motion_gating)
+		{
+			const unsigned int coarse_level = ctf_levels - 1 + round(log2(width/cols));
+			gating_depth_clustered = depth_old[coarse_level];
+			gating_intensity_clustered = intensity_old[coarse_level];
+		}
 
+		//Create the pyramid for the labels
+		if (label_pyramid_by_downsampling)	createLabelsPyramidByDownsampling();
+		else								createLabelsPyramidUsingKMeans();
 
-    //Solve the multi-odometry problem (coarse-to-fine)
-    //-------------------------------------------------------------------------------------
-    //Set the overall transformations to 0
-    T_odometry.setIdentity();
-    for (unsigned int l=0; l<NUM_LABELS; l++)
-        T_clusters[l].setIdentity();
+		//Compute warped b_segmentation (necessary for the robust estimation)
+		computeSegTemporalRegValues();
+	}
+	else
+	{
+		//The clusters are the same as in the last frame, and so is their segmentation
+		b_segm_warped = b_segm;
+		for (unsigned int l=0; l<NUM_LABELS; l++)
+			cluster_match[l] = (size_kmeans[l] != 0) ? int(l) : -1;
 
-    //Coarse-to-fine
-    for (unsigned int i=0; i<ctf_levels; i++)
-    {
-        level = i;
-        unsigned int s = pow(2.f,int(ctf_levels-(i+1)));
-        cols_i = cols/s; rows_i = rows/s;
-        image_level = ctf_levels - i + round(log2(width/cols)) - 1;
+		//The incremental clustering would warp the clusters with the motion of this frame only
+		clustering_state_valid = false;
+	}
 
-        //1. Perform warping
-        //Info: The accuracy of the odometry is slightly better using the other warping but I cannot use it here because
-        // the labels are defined in the old image (better about 7% for the only sequence I have tested)
-        if (i == 0)
-        {
-            depth_warped[image_level] = depth[image_level];
-            intensity_warped[image_level] = intensity[image_level];
-            xx_warped[image_level] = xx[image_level];
-            yy_warped[image_level] = yy[image_level];
-        }
-        else
-            warpImagesParallel();
 
-        //2. Compute inter coords
-        computeCoordsParallel();
+	if ((reuse != REUSE_SEGMENTATION)&&!(use_single_pass && segmentStaticDynamicFromTemporal()))
+	{
+		//Solve a robust odometry problem to segment the background (coarse-to-fine)
+		//---------------------------------------------------------------------------------
+		solveRobustOdometryCoarseToFine();
 
-        //3. Compute derivatives
-        calculateDerivatives();
+		//Segment static and dynamic parts
+		segmentStaticDynamic();
+		two_pass_frames++;
+	}
 
-        //4. Compute weights
-        computeWeights();
 
-        //5. Solve odometry
-        solveMotionAllClusters();
-    }
+	//Solve the multi-odometry problem (coarse-to-fine)
+	//-------------------------------------------------------------------------------------
+	solveMultiOdometryCoarseToFine();
 
-    //Update camera pose from the "static" motion estimate
-    updateCameraPoseFromOdometry();
+	//Update camera pose from the "static" motion estimate
+	updateCameraPoseFromOdometry();
 
-    //Refine static/dynamic segmentation and warp it to use it in the next iteration
-    segmentStaticDynamic();
-    warpStaticDynamicSegmentation();
+	//Refine static/dynamic segmentation and warp it to use it in the next iteration
+	if (reuse != REUSE_SEGMENTATION)
+	{
+		segmentStaticDynamic();
+		warpStaticDynamicSegmentation();
+	}
 
     //Compute the scene flow from the rigid motions and the labels
-    computeSceneFlowFromRigidMotions();
+	computeSceneFlowFromRigidMotions();
 }
 
 void VO_SF::computeSceneFlowFromRigidMotions()
 {
-	const unsigned int repr_level = round(log2(width/cols));
+	MatrixXf &mx = motionfield[0];
+	MatrixXf &my = motionfield[1];
+	MatrixXf &mz = motionfield[2];
+	mx.assign(0.f); my.assign(0.f); mz.assign(0.f);
+
+	//Nothing else to do if all the clusters are static
+	bool any_dynamic = false;
+	for (unsigned int l=0; l<NUM_LABELS; l++)
+		any_dynamic |= label_dynamic[l];
+
+	if (!any_dynamic)
+		return;
 
     //Compute the inverse rigid transformation associated to the labels
-    Matrix4f inv_trans[NUM_LABELS];
     for (unsigned int l=0; l<NUM_LABELS; l++)
-        inv_trans[l] = T_clusters[l].inverse();
+        T_clusters_inv[l] = se3::inverse(T_clusters[l]);
 
 	//Refs
+	const unsigned int repr_level = round(log2(width/cols));
 	const MatrixXf &depth_old_ref = depth_old[repr_level];
-	const MatrixXf &xx_old_ref = xx_old[repr_level];
-	const MatrixXf &yy_old_ref = yy_old[repr_level];
-	const Matrix<float, NUM_LABELS+1, Dynamic> &label_funct_ref = label_funct[image_level];
-	const MatrixXi &labels_ref = labels[image_level];
-
-	MatrixXf &mx = motionfield[0];
-	MatrixXf &my = motionfield[1];
-	MatrixXf &mz = motionfield[2];
+	const MatrixLabels &labels_ref = labels[image_level];
 
 	//Build a mask for clusters whose scene flow should not be computed
-	Matrix<bool, NUM_LABELS, 1> ignore_label; ignore_label.fill(true);
+	Matrix<bool, NUM_LABELS+1, 1> ignore_label; ignore_label.fill(true);
 	for (unsigned int l_here=0; l_here<NUM_LABELS; l_here++)
 		for (unsigned int l=0; l<NUM_LABELS; l++)
 			if (connectivity[l_here][l])
@@ -1287,42 +1707,57 @@ void VO_SF::computeSceneFlowFromRigidMotions()
 					continue;
 				}
 
-	Matrix4f trans; 
+	//Compact list with the pixels of the dynamic clusters (or connected to them)
+	scene_flow_pixels.clear();
     for (unsigned int u = 0; u<cols; u++)
         for (unsigned int v = 0; v<rows; v++)
-        {
-			const float z = depth_old_ref(v,u);
-			const int pixel_label = v + u*rows;
+			if ((depth_old_ref(v,u) != 0.f)&&(!ignore_label(labels_ref(v,u))))
+				scene_flow_pixels.push_back(v + u*rows);
 
-			if ((z != 0.f)&&(!ignore_label(labels_ref(v,u))))
-            {			
-				//Interpolate between the transformations
-                trans.fill(0.f);
-				bool pixel_static = true;
+	VO_SF_RangeFunctor<&VO_SF::computeSceneFlowFromRigidMotions> delegate(*this);
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, scene_flow_pixels.size(), 256), delegate);
+}
 
-                for (unsigned int l=0; l<NUM_LABELS; l++)
-				{
-					if ((label_funct_ref(l,pixel_label) != 0.f))
-					{
-                        trans += label_funct_ref(l,pixel_label)*inv_trans[l];
+void VO_SF::computeSceneFlowFromRigidMotions(size_t first, size_t last)
+{
+	//Refs
+	const unsigned int repr_level = round(log2(width/cols));
+	const MatrixXf &depth_old_ref = depth_old[repr_level];
+	const LevelIntrinsics &intr = intrinsics[repr_level];
+	const Matrix<float, NUM_LABELS+1, Dynamic> &label_funct_ref = label_funct[image_level];
 
-						if (pixel_static && (label_dynamic[l]))
-							pixel_static = false;
-					}
-				}
+	MatrixXf &mx = motionfield[0];
+	MatrixXf &my = motionfield[1];
+	MatrixXf &mz = motionfield[2];
 
+	Matrix4f trans; 
+	for (size_t k = first; k < last; k++)
+	{
+		const int pixel_label = scene_flow_pixels[k];
+		const unsigned int v = pixel_label%rows, u = pixel_label/rows;
+		const float z = depth_old_ref(v,u);
 
-                
-				if (pixel_static) {mx(v,u) = 0.f; my(v,u) = 0.f; mz(v,u) = 0.f;}
-				else 	//Compute scene flow
-				{
-					mx(v,u) = trans(0,0)*z + trans(0,1)*xx_old_ref(v,u) + trans(0,2)*yy_old_ref(v,u) + trans(0,3) - z;
-					my(v,u) = trans(1,0)*z + trans(1,1)*xx_old_ref(v,u) + trans(1,2)*yy_old_ref(v,u) + trans(1,3) - xx_old_ref(v,u);
-					mz(v,u) = trans(2,0)*z + trans(2,1)*xx_old_ref(v,u) + trans(2,2)*yy_old_ref(v,u) + trans(2,3) - yy_old_ref(v,u);
-				}
-            }
-            else {mx(v,u) = 0.f; my(v,u) = 0.f; mz(v,u) = 0.f; }
-        }
+		//Interpolate between the transformations
+		trans.fill(0.f);
+		bool pixel_static = true;
+
+		for (unsigned int l=0; l<NUM_LABELS; l++)
+			if (label_funct_ref(l,pixel_label) != 0.f)
+			{
+				trans += label_funct_ref(l,pixel_label)*T_clusters_inv[l];
+				pixel_static &= !label_dynamic[l];
+			}
+
+		//Compute scene flow (it is already zero for the static pixels)
+		if (!pixel_static)
+		{
+			const Vector4f p(z, intr.x(z, u), intr.y(z, v), 1.f);
+			const Vector4f flow = trans*p - p;
+			mx(v,u) = flow(0);
+			my(v,u) = flow(1);
+			mz(v,u) = flow(2);
+		}
+	}
 }
 
 
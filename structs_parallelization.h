@@ -31,6 +31,7 @@
 #include <tbb/parallel_invoke.h>
 #include <tbb/parallel_reduce.h>
 #include <tbb/blocked_range2d.h>
+#include <bitset>
 
 
 typedef tbb::blocked_range2d<int> ImageDomain;
@@ -56,11 +57,268 @@ public:
     }
 };
 
+template<void (VO_SF::*F1)(size_t, size_t)>
+class VO_SF_RangeFunctor
+{
+private:
+    VO_SF &self;
+public:
+    VO_SF_RangeFunctor(VO_SF &new_self) : self(new_self) {}
+
+    void operator()(tbb::blocked_range<size_t> const &range) const
+    {
+        (self.*F1)(range.begin(), range.end());
+    }
+};
+
+struct SmoothRegionsFn
+{
+    VO_SF &self;
+    unsigned int image_level;
+
+    SmoothRegionsFn(VO_SF &new_self, unsigned int new_image_level) : self(new_self), image_level(new_image_level) {}
+
+    void operator()(tbb::blocked_range<unsigned int> const &range) const
+    {
+        self.smoothRegions(image_level, range.begin(), range.end());
+    }
+};
+
+//Downsampling of the labels: columns of a level
+struct LabelPyramidColumnsFn
+{
+    VO_SF &self;
+    unsigned int level_ctf;
+
+    LabelPyramidColumnsFn(VO_SF &new_self, unsigned int new_level_ctf) : self(new_self), level_ctf(new_level_ctf) {}
+
+    void operator()(tbb::blocked_range<unsigned int> const &range) const
+    {
+        self.downsampleLabels(level_ctf, range.begin(), range.end());
+    }
+};
+
+//Label of a k-means center and its (squared) distance to another center
+struct IndexAndDistance
+{
+    int idx;
+    float distance;
+
+    bool operator<(const IndexAndDistance &o) const
+    {
+        return distance < o.distance;
+    }
+};
+
+//Per-label bookkeeping of the clustering at the max resolution
+struct ClusterStatistics
+{
+    int count[NUM_LABELS];
+    float b_sum[NUM_LABELS];
+    float coord_sum[NUM_LABELS][3];         //Sum of the 3D coordinates of the points of every cluster (to update the centers)
+    std::bitset<NUM_LABELS> adjacency[NUM_LABELS];     //Bit l of adjacency[k] is set if clusters k and l are contiguous
+
+    ClusterStatistics()
+    {
+        for (unsigned int l=0; l<NUM_LABELS; l++)
+        {
+            count[l] = 0;
+            b_sum[l] = 0.f;
+            coord_sum[l][0] = coord_sum[l][1] = coord_sum[l][2] = 0.f;
+            adjacency[l].set(l);
+        }
+    }
+
+    struct Reduce
+    {
+        ClusterStatistics operator()(const ClusterStatistics& a, const ClusterStatistics& b) const
+        {
+            ClusterStatistics result;
+            for (unsigned int l=0; l<NUM_LABELS; l++)
+            {
+                result.count[l] = a.count[l] + b.count[l];
+                result.b_sum[l] = a.b_sum[l] + b.b_sum[l];
+                for (unsigned int c=0; c<3; c++)
+                    result.coord_sum[l][c] = a.coord_sum[l][c] + b.coord_sum[l][c];
+                result.adjacency[l] = a.adjacency[l] | b.adjacency[l];
+            }
+            return result;
+        }
+    };
+};
+
+//Labels, sizes, temporal-regularization sums and connectivity of the clusters in a single sweep (max resolution)
+//Every chunk of columns also recomputes the labels of the column preceding it to find the horizontal contacts
+//Without centers (incremental clustering) the labels already stored are used instead of being computed
+struct ClusterStatisticsFn
+{
+    VO_SF &self;
+    const Eigen::MatrixXf *centers;
+    const std::vector<std::vector<IndexAndDistance> > *cluster_distances;
+    const ClusterGrid *grid;        //Only used by the local clustering (NULL otherwise)
+    unsigned int level;
+
+    ClusterStatisticsFn(VO_SF &new_self, const Eigen::MatrixXf &new_centers, const std::vector<std::vector<IndexAndDistance> > &new_cluster_distances, const ClusterGrid *new_grid, unsigned int new_level)
+        : self(new_self), centers(&new_centers), cluster_distances(&new_cluster_distances), grid(new_grid), level(new_level) {}
+
+    ClusterStatisticsFn(VO_SF &new_self, unsigned int new_level)
+        : self(new_self), centers(NULL), cluster_distances(NULL), grid(NULL), level(new_level) {}
+
+    //Closest kmean, starting the search from the label of the lower resolution level (or among the clusters around the pixel)
+    unsigned int closestLabel(unsigned int v, unsigned int u) const
+    {
+        if (!centers)
+            return self.labels[level](v,u);
+
+        const float z = self.depth_old[level](v,u);
+        if (z == 0.f)
+            return NUM_LABELS;
+
+        const LevelIntrinsics &intr = self.intrinsics[level];
+        const Eigen::Vector3f p(z, intr.x(z, u), intr.y(z, v));
+        if (grid)
+            return grid->closestLabel(*centers, p, v, u);
+
+        const int label_lowres_here = self.labels[level+1](v/2,u/2);
+        const int last_label = (label_lowres_here == NUM_LABELS) ? 0 : label_lowres_here; //If it was invalid in the low res level initialize it randomly (at 0)
+
+        int best_label = last_label;
+        const std::vector<IndexAndDistance> &distances = cluster_distances->at(last_label);
+
+        const float distance_to_last_label = (centers->col(last_label) - p).squaredNorm();
+        float best_distance = distance_to_last_label;
+
+        for (size_t li = 1; li < distances.size(); ++li)
+        {
+            const IndexAndDistance &idx_and_distance = distances.at(li);
+            if (idx_and_distance.distance > 4.f*distance_to_last_label) break;
+
+            const float distance_to_label = (centers->col(idx_and_distance.idx) - p).squaredNorm();
+            if (distance_to_label < best_distance)
+            {
+                best_distance = distance_to_label;
+                best_label = idx_and_distance.idx;
+            }
+        }
+        return best_label;
+    }
+
+    ClusterStatistics operator()(tbb::blocked_range<unsigned int> const &range, const ClusterStatistics &initial) const
+    {
+        const unsigned int rows = self.rows, cols = self.cols;
+        const float dist_threshold = 0.03f*120.f/float(rows);
+        const float dist2_threshold = dist_threshold*dist_threshold;
+
+        //Refs
+        const Eigen::MatrixXf &depth_ref = self.depth_old[level];
+        const Eigen::MatrixXf &b_segm_ref = self.b_segm_image_warped;
+        const LevelIntrinsics &intr = self.intrinsics[level];
+        MatrixLabels &labels_ref = self.labels[level];
+
+        ClusterStatistics result(initial);
+        std::vector<unsigned char> prev_labels(rows, NUM_LABELS);
+        if (range.begin() > 0)
+            for (unsigned int v=0; v<rows; v++)
+                prev_labels[v] = closestLabel(v, range.begin()-1);
+
+        for (unsigned int u=range.begin(); u<range.end(); u++)
+        {
+            //Without centers the stored labels are only read (the next chunk also reads the last column of this one)
+            if (centers)
+                for (unsigned int v=0; v<rows; v++)
+                    labels_ref(v,u) = closestLabel(v,u);
+
+            for (unsigned int v=0; v<rows; v++)
+            {
+                const unsigned int lab = labels_ref(v,u);
+                if (lab == NUM_LABELS)
+                    continue;
+
+                const float z = depth_ref(v,u);
+                result.count[lab]++;
+                result.b_sum[lab] += b_segm_ref(v,u);
+                result.coord_sum[lab][0] += z;
+                result.coord_sum[lab][1] += intr.x(z, u);
+                result.coord_sum[lab][2] += intr.y(z, v);
+
+                if (v == rows-1)
+                    continue;
+
+                //Detect change in the labelling (v+1,u)
+                const unsigned int lab_down = labels_ref(v+1,u);
+                if ((u < cols-1)&&(lab != lab_down)&&(lab_down != NUM_LABELS))
+                {
+                    const float dz = z - depth_ref(v+1,u), dy = intr.y(z, v) - intr.y(depth_ref(v+1,u), v+1);
+                    const float disty = dz*dz + dy*dy;
+                    if (disty < dist2_threshold)
+                    {
+                        result.adjacency[lab].set(lab_down);
+                        result.adjacency[lab_down].set(lab);
+                    }
+                }
+
+                //Detect change in the labelling (v,u-1)
+                const unsigned int lab_left = prev_labels[v];
+                if ((lab != lab_left)&&(lab_left != NUM_LABELS))
+                {
+                    const float dz = depth_ref(v,u-1) - z, dx = intr.x(depth_ref(v,u-1), u-1) - intr.x(z, u);
+                    const float distx = dz*dz + dx*dx;
+                    if (distx < dist2_threshold)
+                    {
+                        result.adjacency[lab].set(lab_left);
+                        result.adjacency[lab_left].set(lab);
+                    }
+                }
+            }
+
+            for (unsigned int v=0; v<rows; v++)
+                prev_labels[v] = labels_ref(v,u);
+        }
+
+        return result;
+    }
+};
+
 typedef dvo::NormalEquation<float, 6, 2> NormalEquation;
 
+//Layout of the Jacobian and the residuals of a pixel with both rows (photometric and geometric) or only one of them
+template<int Rows> struct ResidualLayout;
+
+template<> struct ResidualLayout<2>
+{
+    typedef dvo::NormalEquation<float, 6, 2> NormalEquation;
+    typedef JacobianT Jacobian;
+    typedef ResidualT Residual;
+    static const int JacobianStride = JacobianElements;
+    static const int ResidualStride = ResidualElements;
+
+    //w are the weights of every row (diagonal information matrix)
+    static inline void update(NormalEquation &nes, const float *J, const float *r, const float *w)
+    {
+        MEMORY_ALIGN16(float info[4]);
+        info[0] = w[0]; info[1] = info[2] = 0.f; info[3] = w[1];
+        nes.update(J, r, info);
+    }
+};
+
+template<> struct ResidualLayout<1>
+{
+    typedef dvo::NormalEquation<float, 6, 1> NormalEquation;
+    typedef Eigen::Matrix<float, 1, 6> Jacobian;
+    typedef Eigen::Matrix<float, 1, 1> Residual;
+    static const int JacobianStride = 8;	//Padded for the aligned loads of the 6x1 kernel
+    static const int ResidualStride = 1;
+
+    static inline void update(NormalEquation &nes, const float *J, const float *r, const float *w)
+    {
+        nes.update(J, r[0], w[0]);
+    }
+};
+
+template<int Rows>
 struct NormalEquationAndChi2
 {
-    NormalEquation nes;
+    typename ResidualLayout<Rows>::NormalEquation nes;
     float chi2;
 
     NormalEquationAndChi2()
@@ -83,142 +341,316 @@ struct NormalEquationAndChi2
     };
 };
 
+//Inputs needed to compute the Jacobian and the residuals of a pixel at the current level
+struct JacobianInputs
+{
+    Eigen::MatrixXf const &depth_inter;
+    LevelIntrinsics const &intr;
+    MatrixLabels const &labels;
+    Eigen::MatrixXf const &dcu, &dcv, &dct, &ddu, &ddv, &ddt;
+    Eigen::MatrixXf const &weights_c, &weights_d;
+    Eigen::Matrix<float, NUM_LABELS, 1> const &b_segm_warped;
+    Eigen::MatrixXf const *b_segm_image;
+    float f_inv, k_photometric_res;
+    int segm_step;
+    bool use_b_segm_warped;	//Per-cluster segmentation (there are no clusters in the odometry-only mode)
+    bool geometric;	//Row kept when only one residual is used (geometric or photometric)
+
+    JacobianInputs(VO_SF const &self) :
+        depth_inter(self.depth_inter[self.image_level]), intr(self.intrinsics[self.image_level]), labels(self.labels[self.image_level]),
+        dcu(self.dcu), dcv(self.dcv), dct(self.dct), ddu(self.ddu), ddv(self.ddv), ddt(self.ddt),
+        weights_c(self.weights_c), weights_d(self.weights_d), b_segm_warped(self.b_segm_warped)
+    {
+        geometric = (self.residual_mode != VO_SF::RESIDUALS_PHOTOMETRIC);
+        f_inv = intr.f;
+        k_photometric_res = self.k_photometric_res;
+        use_b_segm_warped = !self.odometry_only;
+
+        //Without clusters (odometry only) the last segmentation can still be used per pixel (it is stored at the max resolution)
+        b_segm_image = (self.odometry_only && self.odometry_only_reuse_segm) ? &self.b_segm_image_warped : 0;
+        segm_step = 1 << (self.image_level - int(round(log2(self.width/self.cols))));
+    }
+
+    //                                          Intensity
+    //------------------------------------------------------------------------------------------------
+    template<int Stride>
+    inline void photometricRow(int v, int u, float twc, float d, float inv_d, float x, float y, float *J, float *r) const
+    {
+        const float dycomp_c = dcu(v,u)*f_inv*inv_d;
+        const float dzcomp_c = dcv(v,u)*f_inv*inv_d;
+
+        //Fill the matrix A
+        J[0*Stride] = twc*(dycomp_c*x*inv_d + dzcomp_c*y*inv_d);
+        J[1*Stride] = twc*(-dycomp_c);
+        J[2*Stride] = twc*(-dzcomp_c);
+        J[3*Stride] = twc*(dycomp_c*y - dzcomp_c*x);
+        J[4*Stride] = twc*(dycomp_c*inv_d*y*x + dzcomp_c*(y*y*inv_d + d));
+        J[5*Stride] = twc*(-dycomp_c*(x*x*inv_d + d) - dzcomp_c*inv_d*y*x);
+        *r = twc*(-dct(v,u));
+    }
+
+    //                                          Geometry
+    //------------------------------------------------------------------------------------------------
+    template<int Stride>
+    inline void geometricRow(int v, int u, float twd, float d, float inv_d, float x, float y, float *J, float *r) const
+    {
+        const float dycomp_d = ddu(v,u)*f_inv*inv_d;
+        const float dzcomp_d = ddv(v,u)*f_inv*inv_d;
+
+        //Fill the matrix A
+        J[0*Stride] = twd*(1.f + dycomp_d*x*inv_d + dzcomp_d*y*inv_d);
+        J[1*Stride] = twd*(-dycomp_d);
+        J[2*Stride] = twd*(-dzcomp_d);
+        J[3*Stride] = twd*(dycomp_d*y - dzcomp_d*x);
+        J[4*Stride] = twd*(y + dycomp_d*inv_d*y*x + dzcomp_d*(y*y*inv_d + d));
+        J[5*Stride] = twd*(-x - dycomp_d*(x*x*inv_d + d) - dzcomp_d*inv_d*y*x);
+        *r = twd*(-ddt(v,u));
+    }
+
+    //Jacobian (column-major, ResidualLayout<Rows>) and residuals of a pixel with the weights given by the Weighting policy
+    template<int Rows, class Weighting>
+    inline void compute(int v, int u, float *J, float *r) const;
+};
+
+//Weighting policies for the Jacobians
+//Pre-weighting of the multi-odometry pass (computeWeights)
+struct PreWeighting
+{
+    static inline void weights(JacobianInputs const &in, int v, int u, float &twc, float &twd)
+    {
+        twc = in.weights_c(v,u)*in.k_photometric_res;
+        twd = in.weights_d(v,u);
+    }
+};
+
+//Robust odometry: depth and the (warped) segmentation of the last frame
+struct RobustWeighting
+{
+    static inline void weights(JacobianInputs const &in, int v, int u, float &twc, float &twd)
+    {
+        float w_dinobj = 1.f;
+        if (in.use_b_segm_warped)
+            w_dinobj = std::max(0.f, 1.f - in.b_segm_warped[in.labels(v,u)]);
+        else if (in.b_segm_image)
+            w_dinobj = std::max(0.f, 1.f - (*in.b_segm_image)(in.segm_step*v, in.segm_step*u));
+
+        twd = w_dinobj*in.depth_inter(v,u);
+        twc = twd*in.k_photometric_res;
+    }
+};
+
+template<int Rows, class Weighting>
+inline void JacobianInputs::compute(int v, int u, float *J, float *r) const
+{
+    float twc, twd;
+    Weighting::weights(*this, v, u, twc, twd);
+
+    // Precomputed expressions
+    const float d = depth_inter(v,u);
+    const float inv_d = 1.f/d;
+    const float x = intr.x(d, u);
+    const float y = intr.y(d, v);
+
+    if (Rows == 2)
+    {
+        photometricRow<2>(v, u, twc, d, inv_d, x, y, J, r);
+        geometricRow<2>(v, u, twd, d, inv_d, x, y, J + 1, r + 1);
+    }
+    else
+    {
+        if (geometric)	geometricRow<1>(v, u, twd, d, inv_d, x, y, J, r);
+        else			photometricRow<1>(v, u, twc, d, inv_d, x, y, J, r);
+        J[6] = J[7] = 0.f;
+    }
+}
+
+template<int Rows>
 struct IrlsContext
 {
+    typedef ResidualLayout<Rows> Layout;
+
     float *A, *B;
     float k_Cauchy, Cauchy_factor;
 	float sum_residuals;
 	unsigned int num_pixels;
     Vector6f Var;
-	Eigen::VectorXf residuals;
 
+	//If set, the Jacobians are recomputed from the pixel inputs instead of read from A and B
+	JacobianInputs const *inputs;
+	std::vector<std::pair<int,int> > const *indices;
 
-	inline void computeNewResiduals()
+	IrlsContext() : inputs(0), indices(0) {}
+
+	//J_local and r_local are only used (and the pointers set to them) if the Jacobian is recomputed.
+	//The recomputed Jacobians use the Weighting policy of the first pass (known at compile time)
+	template<class Weighting>
+	inline void getJacobian(size_t i, float *J_local, float *r_local, const float *&J, const float *&r) const
 	{
-		//A is sorted weirdly (Jc11, Jd11, Jc12, Jd12...Jc21, Jd21...), so I can't get it complete with:
-		//const MatrixXf J_aux = Map<Matrix<float, 6, Dynamic>>( A, 6, num_equations);
-		//residuals = Map<VectorXf>( B, 2*num_pixels, 1);
-		
-		sum_residuals = 0.f;
-		for (size_t i = 0; i < num_pixels; ++i)
+		if (inputs)
 		{
-			const JacobianT::MapType J(A + i*JacobianElements); 
-			const ResidualT::MapType r(B + i*ResidualElements);
-			residuals.block<2,1>(2*i,0) = J*Var - r;
-			sum_residuals += std::abs(residuals(2*i)) + std::abs(residuals(2*i+1));
+			const std::pair<int, int> &vu = (*indices)[i];
+			inputs->compute<Rows, Weighting>(vu.first, vu.second, J_local, r_local);
+			J = J_local; r = r_local;
+		}
+		else
+		{
+			J = A + i*Layout::JacobianStride;
+			r = B + i*Layout::ResidualStride;
 		}
-
-		const float mean_res = std::max(1e-5f, sum_residuals/float(2*num_pixels));
-		k_Cauchy = Cauchy_factor/(mean_res*mean_res);
 	}
+
+	template<class Weighting>
+	inline void computeNewResiduals();
 };
 
-struct IrlsElementFn
+//IRLS sweep: the Jacobians of every pixel are read or recomputed with the Weighting policy, and reduced with the Output policy
+template<int Rows, class Weighting, class Output>
+struct IrlsKernelFn
 {
     typedef tbb::blocked_range<size_t> Range;
-    IrlsContext const &ctx;
+    typedef typename Output::Result Result;
+    IrlsContext<Rows> const &ctx;
+    Output output;
 
-    IrlsElementFn(IrlsContext const &new_ctx) : ctx(new_ctx) {}
+    IrlsKernelFn(IrlsContext<Rows> const &new_ctx, Output const &new_output) : ctx(new_ctx), output(new_output) {}
 
-    inline void update(NormalEquationAndChi2 &nes_and_chi2, Eigen::Matrix2f &info, size_t i) const
+    Result operator()(const Range& range, const Result &initial) const
     {
-		const float res_c = ctx.residuals(2*i);
-		const float res_d = ctx.residuals(2*i+1);
+        Result result(initial);
+        MEMORY_ALIGN16(float J_local[JacobianElements]);
+        MEMORY_ALIGN16(float r_local[4]);
+        const float *J, *r;
+
+        for(Range::const_iterator it = range.begin(); it != range.end(); ++it)
+        {
+            ctx.template getJacobian<Weighting>(it, J_local, r_local, J, r);
+            output(result, it, J, r);
+        }
 
-		//Intensity and depth weights
-        const float res_weight_intensity = 1.f/(1.f + ctx.k_Cauchy*res_c*res_c);
-        const float res_weight_depth = 1.f/(1.f + ctx.k_Cauchy*res_d*res_d);
+        return result;
+    }
+};
 
-        info(0,0) = res_weight_intensity;
-        info(1,1) = res_weight_depth;
+//Output policies for the IRLS sweeps
+//Sum of the absolute residuals with the current solution (to update the Cauchy parameter)
+template<int Rows>
+struct IrlsResidualSumOutput
+{
+    typedef float Result;
+    typedef ResidualLayout<Rows> Layout;
+    IrlsContext<Rows> const *ctx;
 
-		//Update matrices
-		const float *A_elem = ctx.A + i*JacobianElements;
-		const float *B_elem = ctx.B + i*ResidualElements;
-		nes_and_chi2.nes.update(A_elem, B_elem, info.data());
+    IrlsResidualSumOutput(IrlsContext<Rows> const &new_ctx) : ctx(&new_ctx) {}
 
-		//Update chi2
-        nes_and_chi2.chi2 += res_c*res_c*res_weight_intensity + res_d*res_d*res_weight_depth;
+    inline void operator()(Result &result, size_t, const float *J, const float *r) const
+    {
+        const typename Layout::Residual res = typename Layout::Jacobian::ConstMapType(J)*ctx->Var - typename Layout::Residual::ConstMapType(r);
+        result += res.cwiseAbs().sum();
     }
+};
+
+//Fused IRLS step: residuals with the current solution, Cauchy weights and normal equations in a single pass
+//(the residuals are not stored between the two sweeps of an iteration)
+template<int Rows>
+struct IrlsOutput
+{
+    typedef NormalEquationAndChi2<Rows> Result;
+    typedef ResidualLayout<Rows> Layout;
+    IrlsContext<Rows> const *ctx;
+
+    IrlsOutput(IrlsContext<Rows> const &new_ctx) : ctx(&new_ctx) {}
 
-    NormalEquationAndChi2 operator()(const Range& range, const NormalEquationAndChi2 &initial) const
+    inline void operator()(Result &result, size_t, const float *J, const float *r) const
     {
-        NormalEquationAndChi2 r(initial);
-        Eigen::Matrix2f info = Eigen::Matrix2f::Identity();
-        for(Range::const_iterator it = range.begin(); it != range.end(); ++it)
-        {
-            update(r, info, it);
-        }
+        const typename Layout::Residual res = typename Layout::Jacobian::ConstMapType(J)*ctx->Var - typename Layout::Residual::ConstMapType(r);
 
-        return r;
+		//Intensity and depth weights (or the weight of the only residual)
+		float res_weight[Rows];
+		for (int k=0; k<Rows; k++)
+		{
+			res_weight[k] = 1.f/(1.f + ctx->k_Cauchy*res(k)*res(k));
+			result.chi2 += res(k)*res(k)*res_weight[k];
+		}
+
+		Layout::update(result.nes, J, r, res_weight);
     }
 };
 
-struct JacobianElementFn
+template<int Rows>
+template<class Weighting>
+inline void IrlsContext<Rows>::computeNewResiduals()
 {
-    typedef tbb::blocked_range<size_t> Range;
-    SolveForMotionWorkspace const &ws;
-    VO_SF const &self;
+	typedef IrlsKernelFn<Rows, Weighting, IrlsResidualSumOutput<Rows> > Fn;
+	Fn fn(*this, IrlsResidualSumOutput<Rows>(*this));
+	typename Fn::Range range(0, num_pixels, 32);
+
+	//The stored Jacobians are simply streamed (linear version), the recomputed ones are processed in parallel
+	if (inputs)
+		sum_residuals = tbb::parallel_reduce(range, 0.f, fn, std::plus<float>());
+	else
+		sum_residuals = fn(range, 0.f);
+
+	const float mean_res = std::max(1e-5f, sum_residuals/float(Rows*num_pixels));
+	k_Cauchy = Cauchy_factor/(mean_res*mean_res);
+}
 
-    JacobianElementFn(SolveForMotionWorkspace const &new_ws, VO_SF const &new_self) : ws(new_ws), self(new_self) {}
+//Output policies for the Jacobian kernel (what is reduced after computing and storing the Jacobian of every pixel)
+//Store-and-accumulate: pre-weighted normal equations
+template<int Rows>
+struct AccumulateOutput
+{
+    typedef NormalEquationAndChi2<Rows> Result;
+
+    inline void operator()(Result &result, size_t, const float *J, const float *r) const
+    {
+        const float w[2] = {1.f, 1.f};
+        ResidualLayout<Rows>::update(result.nes, J, r, w);
+    }
+};
+
+//Residual-sum only: the normal equations are built later with the IRLS weights
+template<int Rows>
+struct ResidualSumOutput
+{
+    typedef float Result;
 
-    NormalEquationAndChi2 operator()(const Range& range, const NormalEquationAndChi2 &initial) const
+    inline void operator()(Result &result, size_t, const float *, const float *r) const
     {
-        const float f_inv = float(self.cols_i)/(2.f*tan(0.5f*self.fovh));
+        for (int k=0; k<Rows; k++)
+            result += std::abs(r[k]);
+    }
+};
 
-        NormalEquationAndChi2 result(initial);
-        Eigen::Matrix2f info = Eigen::Matrix2f::Identity();
+//Jacobians of the pixels in ws.indices, computed with the Weighting policy, stored as requested and reduced with the Output policy
+template<int Rows, class Weighting, class Output>
+struct JacobianKernelFn
+{
+    typedef tbb::blocked_range<size_t> Range;
+    typedef ResidualLayout<Rows> Layout;
+    typedef typename Output::Result Result;
+    SolveForMotionWorkspace const &ws;
+    JacobianInputs const &inputs;
+    JacobianStorage storage;
+    Output output;
+
+    JacobianKernelFn(SolveForMotionWorkspace const &new_ws, JacobianInputs const &new_inputs, JacobianStorage new_storage, Output const &new_output = Output())
+        : ws(new_ws), inputs(new_inputs), storage(new_storage), output(new_output) {}
 
-        Eigen::MatrixXf const& depth_inter_ = self.depth_inter[self.image_level];
-        Eigen::MatrixXf const& xx_inter_ = self.xx_inter[self.image_level];
-        Eigen::MatrixXf const& yy_inter_ = self.yy_inter[self.image_level];
+    Result operator()(const Range& range, const Result &initial) const
+    {
+        Result result(initial);
+        MEMORY_ALIGN16(float J_local[JacobianElements]);
+        MEMORY_ALIGN16(float r_local[4]);
 
         for(Range::const_iterator it = range.begin(); it != range.end(); ++it)
         {
-            JacobianT::MapType J(ws.A + it*JacobianElements);
-            ResidualT::MapType r(ws.B + it*ResidualElements);
+            float *J = (storage == STORE_FLOAT) ? ws.A + it*Layout::JacobianStride : J_local;
+            float *r = (storage == STORE_FLOAT) ? ws.B + it*Layout::ResidualStride : r_local;
 
             const std::pair<int, int> &vu = ws.indices[it];
-            const int &v = vu.first;
-            const int &u = vu.second;
-
-            // Precomputed expressions
-            const float d = depth_inter_(v,u);
-            const float inv_d = 1.f/d;
-            const float x = xx_inter_(v,u);
-            const float y = yy_inter_(v,u);
-
-            //                                          Intensity
-            //------------------------------------------------------------------------------------------------
-            const float dycomp_c = self.dcu(v,u)*f_inv*inv_d;
-            const float dzcomp_c = self.dcv(v,u)*f_inv*inv_d;
-            const float twc = self.weights_c(v,u)*self.k_photometric_res;
-
-            //Fill the matrix A
-            J(0,0) = twc*(dycomp_c*x*inv_d + dzcomp_c*y*inv_d);
-            J(0,1) = twc*(-dycomp_c);
-            J(0,2) = twc*(-dzcomp_c);
-            J(0,3) = twc*(dycomp_c*y - dzcomp_c*x);
-            J(0,4) = twc*(dycomp_c*inv_d*y*x + dzcomp_c*(y*y*inv_d + d));
-            J(0,5) = twc*(-dycomp_c*(x*x*inv_d + d) - dzcomp_c*inv_d*y*x);
-            r(0) = twc*(-self.dct(v,u));
-
-            //                                          Geometry
-            //------------------------------------------------------------------------------------------------
-            const float dycomp_d = self.ddu(v,u)*f_inv*inv_d;
-            const float dzcomp_d = self.ddv(v,u)*f_inv*inv_d;
-            const float twd = self.weights_d(v,u);
-
-            //Fill the matrix A
-            J(1,0) = twd*(1.f + dycomp_d*x*inv_d + dzcomp_d*y*inv_d);
-            J(1,1) = twd*(-dycomp_d);
-            J(1,2) = twd*(-dzcomp_d);
-            J(1,3) = twd*(dycomp_d*y - dzcomp_d*x);
-            J(1,4) = twd*(y + dycomp_d*inv_d*y*x + dzcomp_d*(y*y*inv_d + d));
-            J(1,5) = twd*(-x - dycomp_d*(x*x*inv_d + d) - dzcomp_d*inv_d*y*x);
-            r(1) = twd*(-self.ddt(v,u));
-
-            result.nes.update(J.data(), r.data(), info.data());
+            inputs.compute<Rows, Weighting>(vu.first, vu.second, J, r);
+
+            output(result, it, J, r);
         }
 
         return result;
@@ -226,79 +658,233 @@ struct JacobianElementFn
 };
 
 
-struct JacobianElementForRobustOdometryFn
+
+//                 Single-sweep solver for all the clusters
+//----------------------------------------------------------------------------
+//Every dynamic cluster has its own slot and the static ones share the last slot (background)
+static const unsigned int BackgroundSlot = NUM_LABELS;
+static const unsigned int NumSlots = NUM_LABELS+1;
+
+struct MultiClusterContext
 {
-    typedef tbb::blocked_range<size_t> Range;
-    SolveForMotionWorkspace const &ws;
-    VO_SF const &self;
+    IrlsContext<2> jacobians;                   //Only used to read the Jacobians (stored or recomputed) in the IRLS sweeps
+    std::vector<unsigned int> first_slot;       //The slots of pixel i are slots[first_slot[i]] ... slots[first_slot[i+1]-1]
+    std::vector<unsigned char> slots;
+    std::vector<unsigned char> background_mult; //Number of static clusters of every pixel (it is counted once per cluster, as with the indices)
+    Vector6f twist[NumSlots];
+    float k_Cauchy[NumSlots];
+    bool active[NumSlots];                      //Slots whose IRLS has not converged yet
+
+    inline float weight(size_t i, unsigned int slot) const
+    {
+        return (slot == BackgroundSlot) ? float(background_mult[i]) : 1.f;
+    }
+};
+
+struct MultiClusterNormalEquations
+{
+    NormalEquation nes[NumSlots];
+    float chi2[NumSlots];
+
+    MultiClusterNormalEquations()
+    {
+        for (unsigned int s=0; s<NumSlots; s++)
+        {
+            nes[s].setZero();
+            chi2[s] = 0.f;
+        }
+    }
+
+    //Pre-weighting only (irls = false) or Cauchy weights computed with the current twist of every slot
+    inline void accumulate(MultiClusterContext const &ctx, size_t i, const float *J, const float *r, bool irls)
+    {
+        MEMORY_ALIGN16(float info[4]);
+        info[1] = info[2] = 0.f;
 
-    JacobianElementForRobustOdometryFn(SolveForMotionWorkspace const &new_ws, VO_SF const &new_self) : ws(new_ws), self(new_self) {}
+        for (unsigned int k = ctx.first_slot[i]; k < ctx.first_slot[i+1]; k++)
+        {
+            const unsigned int s = ctx.slots[k];
+            if (!ctx.active[s])
+                continue;
+
+            const float mult = ctx.weight(i, s);
+            if (irls)
+            {
+                const ResidualT res = JacobianT::ConstMapType(J)*ctx.twist[s] - ResidualT::ConstMapType(r);
+                const float res_weight_intensity = 1.f/(1.f + ctx.k_Cauchy[s]*res(0)*res(0));
+                const float res_weight_depth = 1.f/(1.f + ctx.k_Cauchy[s]*res(1)*res(1));
+                info[0] = mult*res_weight_intensity;
+                info[3] = mult*res_weight_depth;
+                chi2[s] += mult*(res(0)*res(0)*res_weight_intensity + res(1)*res(1)*res_weight_depth);
+            }
+            else
+                info[0] = info[3] = mult;
+
+            nes[s].update(J, r, info);
+        }
+    }
 
-    float operator()(const Range& range, const float &initial_mean_residual) const
+    struct Reduce
     {
-        const float f_inv = float(self.cols_i)/(2.f*tan(0.5f*self.fovh));
+        MultiClusterNormalEquations operator()(MultiClusterNormalEquations const& a, MultiClusterNormalEquations const& b) const
+        {
+            MultiClusterNormalEquations result;
+            for (unsigned int s=0; s<NumSlots; s++)
+            {
+                result.nes[s].add(a.nes[s]);
+                result.nes[s].add(b.nes[s]);
+                result.chi2[s] = a.chi2[s] + b.chi2[s];
+            }
+            return result;
+        }
+    };
+};
 
-        float result = initial_mean_residual;
+//Output policy of the Jacobian and IRLS kernels for the single-sweep solver: systems of all the slots of every pixel,
+//pre-weighted (first pass) or with the Cauchy weights of the current twist of every slot (fused IRLS step)
+struct MultiClusterOutput
+{
+    typedef MultiClusterNormalEquations Result;
+    MultiClusterContext const *ctx;
+    bool irls;
 
-        Eigen::MatrixXf const& depth_inter_ = self.depth_inter[self.image_level];
-        Eigen::MatrixXf const& xx_inter_ = self.xx_inter[self.image_level];
-        Eigen::MatrixXf const& yy_inter_ = self.yy_inter[self.image_level];
-        Eigen::MatrixXi const& labels_ref = self.labels[self.image_level];
+    MultiClusterOutput(MultiClusterContext const &new_ctx, bool new_irls = false) : ctx(&new_ctx), irls(new_irls) {}
 
-        for(Range::const_iterator it = range.begin(); it != range.end(); ++it)
+    inline void operator()(Result &result, size_t i, const float *J, const float *r) const
+    {
+        result.accumulate(*ctx, i, J, r, irls);
+    }
+};
+
+//Sum of the absolute residuals of every slot (to set its Cauchy parameter)
+struct MultiClusterResiduals
+{
+    float sum[NumSlots];
+
+    MultiClusterResiduals()
+    {
+        for (unsigned int s=0; s<NumSlots; s++)
+            sum[s] = 0.f;
+    }
+
+    struct Reduce
+    {
+        MultiClusterResiduals operator()(MultiClusterResiduals const& a, MultiClusterResiduals const& b) const
+        {
+            MultiClusterResiduals result;
+            for (unsigned int s=0; s<NumSlots; s++)
+                result.sum[s] = a.sum[s] + b.sum[s];
+            return result;
+        }
+    };
+};
+
+//Output policy of the IRLS kernel for the single-sweep solver: sum of the absolute residuals of every slot
+struct MultiClusterResidualsOutput
+{
+    typedef MultiClusterResiduals Result;
+    MultiClusterContext const *ctx;
+
+    MultiClusterResidualsOutput(MultiClusterContext const &new_ctx) : ctx(&new_ctx) {}
+
+    inline void operator()(Result &result, size_t i, const float *J, const float *r) const
+    {
+        for (unsigned int k = ctx->first_slot[i]; k < ctx->first_slot[i+1]; k++)
         {
-            JacobianT::MapType J(ws.A + it*JacobianElements);
-            ResidualT::MapType r(ws.B + it*ResidualElements);
+            const unsigned int s = ctx->slots[k];
+            if (!ctx->active[s])
+                continue;
 
-            const std::pair<int, int> &vu = ws.indices[it];
-            const int &v = vu.first;
-            const int &u = vu.second;
-
-            // Precomputed expressions
-            const float d = depth_inter_(v,u);
-            const float inv_d = 1.f/d;
-            const float x = xx_inter_(v,u);
-            const float y = yy_inter_(v,u);
-
-            const float w_dinobj = std::max(0.f, 1.f - self.b_segm_warped[labels_ref(v,u)]);
-
-            //                                          Intensity
-            //------------------------------------------------------------------------------------------------
-            const float dycomp_c = self.dcu(v,u)*f_inv*inv_d;
-            const float dzcomp_c = self.dcv(v,u)*f_inv*inv_d;
-            const float twc = w_dinobj*d*self.k_photometric_res;
-
-            //Fill the matrix A
-            J(0,0) = twc*(dycomp_c*x*inv_d + dzcomp_c*y*inv_d);
-            J(0,1) = twc*(-dycomp_c);
-            J(0,2) = twc*(-dzcomp_c);
-            J(0,3) = twc*(dycomp_c*y - dzcomp_c*x);
-            J(0,4) = twc*(dycomp_c*inv_d*y*x + dzcomp_c*(y*y*inv_d + d));
-            J(0,5) = twc*(-dycomp_c*(x*x*inv_d + d) - dzcomp_c*inv_d*y*x);
-            r(0) = twc*(-self.dct(v,u));
-
-            //                                          Geometry
-            //------------------------------------------------------------------------------------------------
-            const float dycomp_d = self.ddu(v,u)*f_inv*inv_d;
-            const float dzcomp_d = self.ddv(v,u)*f_inv*inv_d;
-            const float twd = w_dinobj * d;
-
-            //Fill the matrix A
-            J(1,0) = twd*(1.f + dycomp_d*x*inv_d + dzcomp_d*y*inv_d);
-            J(1,1) = twd*(-dycomp_d);
-            J(1,2) = twd*(-dzcomp_d);
-            J(1,3) = twd*(dycomp_d*y - dzcomp_d*x);
-            J(1,4) = twd*(y + dycomp_d*inv_d*y*x + dzcomp_d*(y*y*inv_d + d));
-            J(1,5) = twd*(-x - dycomp_d*(x*x*inv_d + d) - dzcomp_d*inv_d*y*x);
-            r(1) = twd*(-self.ddt(v,u));
-
-            result += r.cwiseAbs().sum();
+            const ResidualT res = JacobianT::ConstMapType(J)*ctx->twist[s] - ResidualT::ConstMapType(r);
+            result.sum[s] += ctx->weight(i, s)*(std::abs(res(0)) + std::abs(res(1)));
         }
+    }
+};
 
-        return result;
+//Per-label residuals used to segment the scene into static/dynamic clusters
+struct SegmentationResiduals
+{
+    float c[NUM_LABELS], d[NUM_LABELS];
+
+    SegmentationResiduals()
+    {
+        for (unsigned int l=0; l<NUM_LABELS; l++)
+            c[l] = d[l] = 0.f;
     }
+
+    struct Reduce
+    {
+        SegmentationResiduals operator()(const SegmentationResiduals& a, const SegmentationResiduals& b) const
+        {
+            SegmentationResiduals result;
+            for (unsigned int l=0; l<NUM_LABELS; l++)
+            {
+                result.c[l] = a.c[l] + b.c[l];
+                result.d[l] = a.d[l] + b.d[l];
+            }
+            return result;
+        }
+    };
 };
 
+//Edge mask and truncated residuals of every label in a single sweep (full resolution)
+struct SegmentationResidualsFn
+{
+    VO_SF const &self;
+
+    SegmentationResidualsFn(VO_SF const &new_self) : self(new_self) {}
+
+    SegmentationResiduals operator()(const ImageDomain &domain, const SegmentationResiduals &initial) const
+    {
+        const cv::Rect region = toRegion(domain);
+        const unsigned int x = region.tl().x, y = region.tl().y, w = region.width, h = region.height;
+        const unsigned int rows = self.rows, cols = self.cols;
+
+        const float trunc_threshold = 0.2f;
+        const float res_depth_t = 0.1f;
+        const float threshold_edge = 0.3f;
+
+        //Refs
+        Eigen::MatrixXf const& depth_old_ref = self.depth_old[self.image_level];
+        Eigen::MatrixXf const& depth_warped_ref = self.depth_warped[self.image_level];
+        Eigen::MatrixXf const& intensity_old_ref = self.intensity_old[self.image_level];
+        Eigen::MatrixXf const& intensity_warped_ref = self.intensity_warped[self.image_level];
+        MatrixLabels const& labels_ref = self.labels[self.image_level];
+
+        SegmentationResiduals result(initial);
+        for (unsigned int u = std::max(x, 1u); u < std::min(x+w, cols-1); u++)
+            for (unsigned int v = std::max(y, 1u); v < std::min(y+h, rows-1); v++)
+            {
+                const float d_here = depth_old_ref(v,u);
+                if ((d_here == 0.f)||(depth_warped_ref(v,u) == 0.f))
+                    continue;
+
+                //Edges are skipped (their residuals are always high no matter what segment they belong to)
+                const float sum_dif_depth = std::abs(depth_old_ref(v+1,u) - d_here) + std::abs(depth_old_ref(v-1,u) - d_here)
+                                          + std::abs(depth_old_ref(v,u+1) - d_here) + std::abs(depth_old_ref(v,u-1) - d_here);
+                if (sum_dif_depth >= threshold_edge)
+                    continue;
+
+                const unsigned int pixel_label = labels_ref(v,u); //Using the binary segmentation here
+
+                //Truncated Mean with occlusion handling
+                const float dif_depth = d_here - depth_warped_ref(v,u);
+                if (dif_depth < res_depth_t)
+                {
+                    result.d[pixel_label] += std::min(trunc_threshold, std::abs(dif_depth));
+                    result.c[pixel_label] += std::min(0.5f, std::abs(intensity_old_ref(v,u) - intensity_warped_ref(v,u)));
+                }
+                else if (dif_depth < 2.f*res_depth_t)
+                {
+                    const float mult_factor = 2.f*res_depth_t - dif_depth;
+                    result.d[pixel_label] += mult_factor;
+                    result.c[pixel_label] += mult_factor*std::min(0.5f, std::abs(intensity_old_ref(v,u) - intensity_warped_ref(v,u)));
+                }
+            }
+
+        return result;
+    }
+};
 
 // unfortunately we don't have boost or modern c++ :(
 template<class X, void (X::*p)()>
@@ -244,12 +244,9 @@ void VO_SF::updateSceneCamera(bool clean_sf)
 
 	//Refs
 	const MatrixXf &depth_ref = depth[repr_level];
-	const MatrixXf &yy_ref = yy[repr_level];
-	const MatrixXf &xx_ref = xx[repr_level];
-
-	const MatrixXf &depth_old_ref = depth_old[repr_level];
-	const MatrixXf &yy_old_ref = yy_old[repr_level];
-	const MatrixXf &xx_old_ref = xx_old[repr_level];
+	const LevelIntrinsics &intr = intrinsics[repr_level];
+	MatrixXf xx_old_ref, yy_old_ref;
+	computeCoordinates(depth_old[repr_level], repr_level, xx_old_ref, yy_old_ref);
 	
 	scene = window.get3DSceneAndLock();
 
@@ -275,7 +272,7 @@ void VO_SF::updateSceneCamera(bool clean_sf)
 	for (unsigned int u=0; u<cols; u++)
 		for (unsigned int v=0; v<rows; v++)
             if (depth_ref(v,u) != 0.f)
-                kin_points->insertPoint(depth_ref(v,u), xx_ref(v,u), yy_ref(v,u));
+                kin_points->insertPoint(depth_ref(v,u), intr.x(depth_ref(v,u), u), intr.y(depth_ref(v,u), v));
 
 
     //Scene flow
@@ -287,7 +284,7 @@ void VO_SF::updateSceneCamera(bool clean_sf)
     }
 
 	opengl::CVectorField3DPtr sf = scene->getByClass<CVectorField3D>(0);
-    sf->setPointCoordinates(depth_old[repr_level], xx_old[repr_level], yy_old[repr_level]);	
+    sf->setPointCoordinates(depth_old[repr_level], xx_old_ref, yy_old_ref);	
 	sf->setVectorField(motionfield[0], motionfield[1], motionfield[2]);
 
 	//Labels
@@ -314,8 +311,7 @@ void VO_SF::updateSceneDatasets(const CPose3D &gt, const CPose3D &gt_old)
 
 	//Refs
 	const MatrixXf &depth_ref = depth[repr_level];
-	const MatrixXf &yy_ref = yy[repr_level];
-	const MatrixXf &xx_ref = xx[repr_level];
+	const LevelIntrinsics &intr = intrinsics[repr_level];
 	
 	scene = window.get3DSceneAndLock();
 
@@ -336,7 +332,7 @@ void VO_SF::updateSceneDatasets(const CPose3D &gt, const CPose3D &gt_old)
 	for (unsigned int u=0; u<cols; u++)
 		for (unsigned int v=0; v<rows; v++)
             if (depth_ref(v,u) != 0.f)
-				points->push_back(depth_ref(v,u), xx_ref(v,u), yy_ref(v,u),
+				points->push_back(depth_ref(v,u), intr.x(depth_ref(v,u), u), intr.y(depth_ref(v,u), v),
 								im_r(size_factor*v,size_factor*u), im_g(size_factor*v,size_factor*u), im_b(size_factor*v,size_factor*u));
 
 
@@ -386,9 +382,9 @@ void VO_SF::updateSceneImageSeq()
 
 	//Refs
 	const MatrixXf &depth_old_ref = depth_old[repr_level];
-	const MatrixXf &yy_old_ref = yy_old[repr_level];
-	const MatrixXf &xx_old_ref = xx_old[repr_level];
-	const MatrixXi &labels_ref = labels[repr_level];
+	const MatrixLabels &labels_ref = labels[repr_level];
+	MatrixXf xx_old_ref, yy_old_ref;
+	computeCoordinates(depth_old_ref, repr_level, xx_old_ref, yy_old_ref);
 	
 	scene = window.get3DSceneAndLock();
 
@@ -432,7 +428,7 @@ void VO_SF::updateSceneImageSeq()
 	//Scene flow
 	opengl::CVectorField3DPtr sf = scene->getByClass<CVectorField3D>(0);
 	sf->setPose(cam_pose);
-    sf->setPointCoordinates(depth_old[repr_level], xx_old[repr_level], yy_old[repr_level]);
+    sf->setPointCoordinates(depth_old_ref, xx_old_ref, yy_old_ref);
 
 	//Modify scene flow to show only that of the uncertain or dynamic clusters
 	for (unsigned int u=0; u<cols; u++)